@@ -36,19 +36,32 @@
  *
  */
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <latch>
 #include <map>
 #include <memory>
+#include <memory_resource>
 #include <optional>
+#include <span>
+#include <string>
 #include <thread>
 #include <type_traits>
+#include <utility>
 
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "zib/hugepage_resource.hpp"
 #include "zib/overflow_mpsc_queue.hpp"
 #include "zib/spin_mpsc_queue.hpp"
 #include "zib/wait_mpsc_queue.hpp"
@@ -64,8 +77,313 @@ namespace zib::benchmark {
     };
 
     template <typename Queue>
+    static constexpr bool is_blocking = std::is_same_v<
+        decltype(std::declval<Queue&>().dequeue()),
+        typename Queue::value_type>;
+
+    template <typename Queue>
+    static constexpr bool is_overflow =
+        requires(Queue& _queue, typename Queue::value_type _value) {
+            _queue.safe_enqueue(_value, 0);
+        };
+
+    template <typename T>
+    using split_wait_queue = wait_mpsc_queue<
+        T,
+        wait_details::deconstruct_noop<T>,
+        wait_details::kDefaultMPSCSize,
+        wait_details::kDefaultMPSCAllocationBufferSize,
+        {.layout_ = wait_details::node_layout::kSplit}>;
+
+    template <typename T>
+    using split_spin_queue = spin_mpsc_queue<
+        T,
+        spin_details::deconstruct_noop<T>,
+        spin_details::kDefaultMPSCSize,
+        spin_details::kDefaultMPSCAllocationBufferSize,
+        {.layout_ = spin_details::node_layout::kSplit}>;
+
+    template <typename T>
+    using tournament_wait_queue = wait_mpsc_queue<
+        T,
+        wait_details::deconstruct_noop<T>,
+        wait_details::kDefaultMPSCSize,
+        wait_details::kDefaultMPSCAllocationBufferSize,
+        {.selection_ = wait_details::lane_selection::kTournament}>;
+
+    template <typename T>
+    using active_wait_queue = wait_mpsc_queue<
+        T,
+        wait_details::deconstruct_noop<T>,
+        wait_details::kDefaultMPSCSize,
+        wait_details::kDefaultMPSCAllocationBufferSize,
+        {.selection_ = wait_details::lane_selection::kActive}>;
+
+    /* Only per producer order, the producers never touch the shared stamp */
+    template <typename T>
+    using relaxed_wait_queue = wait_mpsc_queue<
+        T,
+        wait_details::deconstruct_noop<T>,
+        wait_details::kDefaultMPSCSize,
+        wait_details::kDefaultMPSCAllocationBufferSize,
+        {.ordering_ = wait_details::ordering::kRelaxed}>;
+
+    /* Stamped from the clock, the producers never touch the shared stamp */
+    template <typename T>
+    using timestamp_wait_queue = wait_mpsc_queue<
+        T,
+        wait_details::deconstruct_noop<T>,
+        wait_details::kDefaultMPSCSize,
+        wait_details::kDefaultMPSCAllocationBufferSize,
+        {.ordering_ = wait_details::ordering::kTimestamp}>;
+
+    /* Each producer reserves StampBlock stamps from the shared stamp at a time */
+    template <typename T, std::size_t StampBlock>
+    using block_wait_queue = wait_mpsc_queue<
+        T,
+        wait_details::deconstruct_noop<T>,
+        wait_details::kDefaultMPSCSize,
+        wait_details::kDefaultMPSCAllocationBufferSize,
+        {.stamp_block_ = StampBlock}>;
+
+    template <typename T>
+    using relaxed_spin_queue = spin_mpsc_queue<
+        T,
+        spin_details::deconstruct_noop<T>,
+        spin_details::kDefaultMPSCSize,
+        spin_details::kDefaultMPSCAllocationBufferSize,
+        {.ordering_ = spin_details::ordering::kRelaxed}>;
+
+    /* Batch > 1 has the producers hand over their elements in batches with enqueue_bulk. Only
+     * the zib queues allocate from _resource.
+     */
+    template <typename Queue, std::size_t Batch = 1>
     std::size_t
-    benchmark_multi_thread(std::size_t _threads, std::size_t _elements);
+    benchmark_multi_thread(
+        std::size_t                _threads,
+        std::size_t                _elements,
+        std::pmr::memory_resource* _resource = std::pmr::new_delete_resource());
+
+    template <typename Queue>
+    Queue
+    make_queue(std::size_t _threads, std::pmr::memory_resource* _resource)
+    {
+        if constexpr (std::is_constructible_v<Queue, std::size_t, std::pmr::memory_resource*>)
+        {
+            return Queue(_threads, _resource);
+        }
+        else
+        {
+            return Queue(_threads);
+        }
+    }
+
+    /* Counts the dTLB load misses of this thread and every thread it starts from now on, or
+     * reports none if perf events aren't available.
+     */
+    class dtlb_counter {
+
+        public:
+
+            dtlb_counter() noexcept
+            {
+                auto config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+                perf_event_attr attr{};
+                attr.type           = PERF_TYPE_HW_CACHE;
+                attr.size           = sizeof(attr);
+                attr.config         = config;
+                attr.disabled       = 1;
+                attr.inherit        = 1;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv     = 1;
+
+                fd_ = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+                if (fd_ >= 0) { ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0); }
+            }
+
+            ~dtlb_counter()
+            {
+                if (fd_ >= 0) { close(fd_); }
+            }
+
+            bool
+            available() const noexcept
+            {
+                return fd_ >= 0;
+            }
+
+            /* The exited threads' counts are folded in, so read after joining them */
+            std::uint64_t
+            misses() const noexcept
+            {
+                std::uint64_t count = 0;
+                if (fd_ < 0 || read(fd_, &count, sizeof(count)) != sizeof(count)) { return 0; }
+
+                return count;
+            }
+
+        private:
+
+            int fd_;
+    };
+
+    template <typename Queue>
+    std::size_t
+    benchmark_lanes(std::size_t _lanes, std::size_t _producers, std::size_t _elements);
+
+    /* The consumer's cost grows with the lanes the queue was built with, not the producers
+     * using them. Shows where the tournament selection overtakes the linear search.
+     */
+    void
+    run_lane_benchmarks(std::size_t _producers, std::size_t _elements)
+    {
+        static constexpr auto kNumberOfRounds = 10;
+
+        for (std::size_t lanes = _producers; lanes <= 256; lanes *= 2)
+        {
+            std::uint64_t linear     = 0;
+            std::uint64_t tournament = 0;
+
+            for (auto round = 0; round < kNumberOfRounds; ++round)
+            {
+                linear += benchmark_lanes<wait_mpsc_queue<std::uint64_t>>(
+                    lanes,
+                    _producers,
+                    _elements);
+
+                tournament += benchmark_lanes<tournament_wait_queue<std::uint64_t>>(
+                    lanes,
+                    _producers,
+                    _elements);
+            }
+
+            std::cout << "lanes " << lanes << ": wait_mpsc_queue[linear]: "
+                      << linear / kNumberOfRounds
+                      << ", wait_mpsc_queue[tournament]: " << tournament / kNumberOfRounds << "\n";
+        }
+    }
+
+    template <typename Queue>
+    std::size_t
+    benchmark_enqueue(std::size_t _lanes, std::size_t _producers, std::size_t _elements);
+
+    /* What the active lane bitmap costs the producers next to the linear search, and what it
+     * saves the whole run, as the idle lanes grow
+     */
+    void
+    run_active_benchmarks(std::size_t _producers, std::size_t _elements)
+    {
+        static constexpr auto kNumberOfRounds = 10;
+
+        for (std::size_t lanes = _producers; lanes <= 256; lanes *= 4)
+        {
+            std::uint64_t linear[2] = {0, 0};
+            std::uint64_t active[2] = {0, 0};
+
+            for (auto round = 0; round < kNumberOfRounds; ++round)
+            {
+                using linear_queue = wait_mpsc_queue<std::uint64_t>;
+                using active_queue = active_wait_queue<std::uint64_t>;
+
+                linear[0] += benchmark_enqueue<linear_queue>(lanes, _producers, _elements);
+                linear[1] += benchmark_lanes<linear_queue>(lanes, _producers, _elements);
+                active[0] += benchmark_enqueue<active_queue>(lanes, _producers, _elements);
+                active[1] += benchmark_lanes<active_queue>(lanes, _producers, _elements);
+            }
+
+            std::cout << "lanes " << lanes
+                      << ": wait_mpsc_queue[linear] enqueue: " << linear[0] / kNumberOfRounds
+                      << ", total: " << linear[1] / kNumberOfRounds
+                      << ", wait_mpsc_queue[active] enqueue: " << active[0] / kNumberOfRounds
+                      << ", total: " << active[1] / kNumberOfRounds << "\n";
+        }
+    }
+
+    template <std::size_t StampBlock>
+    void
+    run_block_benchmark(std::size_t _threads, std::size_t _elements)
+    {
+        static constexpr auto kNumberOfRounds = 10;
+
+        std::uint64_t total = 0;
+        for (auto round = 0; round < kNumberOfRounds; ++round)
+        {
+            total += benchmark_multi_thread<block_wait_queue<std::uint64_t, StampBlock>>(
+                _threads,
+                _elements);
+        }
+
+        std::cout << "stamp block " << StampBlock
+                  << ": wait_mpsc_queue: " << total / kNumberOfRounds << "\n";
+    }
+
+    /* Bigger blocks trade ordering across producers for fewer trips to the shared stamp. An
+     * element's stamp can have been reserved up to StampBlock - 1 of its producer's enqueues
+     * before it.
+     */
+    void
+    run_block_benchmarks(std::size_t _threads, std::size_t _elements)
+    {
+        run_block_benchmark<1>(_threads, _elements);
+        run_block_benchmark<4>(_threads, _elements);
+        run_block_benchmark<16>(_threads, _elements);
+        run_block_benchmark<64>(_threads, _elements);
+        run_block_benchmark<256>(_threads, _elements);
+    }
+
+    /* The same wait_mpsc_queue fed from new and delete, and from a hugepage_resource sized for
+     * its lanes. Reports the time and the dTLB load misses of the producers and the consumer.
+     */
+    void
+    run_hugepage_benchmarks(std::size_t _threads, std::size_t _elements)
+    {
+        using queue_type = wait_mpsc_queue<std::uint64_t>;
+
+        static constexpr auto kNumberOfRounds = 10;
+
+        /* Room for the consumer to fall a few buffers behind before the arena runs out */
+        static constexpr std::size_t kBuffersPerLane = 8;
+
+        const char* backings[] = {"hugetlb", "transparent", "small pages", "upstream"};
+
+        std::uint64_t times[2]  = {0, 0};
+        std::uint64_t misses[2] = {0, 0};
+        bool          counted   = true;
+        const char*   backing   = backings[3];
+
+        for (auto round = 0; round < kNumberOfRounds; ++round)
+        {
+            {
+                dtlb_counter counter;
+                times[0] += benchmark_multi_thread<queue_type>(_threads, _elements);
+                misses[0] += counter.misses();
+                counted = counted && counter.available();
+            }
+
+            {
+                hugepage_resource arena(
+                    hugepage_resource::bytes_for<queue_type>(_threads, kBuffersPerLane));
+                backing = backings[static_cast<int>(arena.kind())];
+
+                dtlb_counter counter;
+                times[1] += benchmark_multi_thread<queue_type>(_threads, _elements, &arena);
+                misses[1] += counter.misses();
+            }
+        }
+
+        const char* names[] = {"wait_mpsc_queue[new_delete]", "wait_mpsc_queue[hugepage]"};
+        for (auto i = 0; i < 2; ++i)
+        {
+            std::cout << names[i] << ": " << times[i] / kNumberOfRounds;
+            if (counted) { std::cout << ", dTLB misses: " << misses[i] / kNumberOfRounds; }
+            std::cout << "\n";
+        }
+
+        std::cout << "hugepage arena backed by " << backing << "\n";
+        if (!counted) { std::cout << "dTLB misses unavailable (perf_event_open failed)\n"; }
+    }
 
     void
     run_benchmarks(std::size_t _threads, std::size_t _elements)
@@ -73,7 +391,7 @@ namespace zib::benchmark {
         std::map<std::string, std::vector<std::uint64_t>> times_;
         size_t                                            count = 0;
 
-        static constexpr auto kNumberOfQueues = 7;
+        static constexpr auto kNumberOfQueues = 13;
         static constexpr auto kNumberOfRounds = 10;
 
         while (count < kNumberOfQueues * kNumberOfRounds)
@@ -127,6 +445,50 @@ namespace zib::benchmark {
                     benchmark_multi_thread<overflow_mpsc_queue<LessMarker>>(_threads, _elements);
                 times_["overflow_mpsc_queue[overflow]"].emplace_back(time);
             }
+            else if (count % kNumberOfQueues == 7)
+            {
+
+                auto time =
+                    benchmark_multi_thread<split_wait_queue<std::uint64_t>>(_threads, _elements);
+                times_["wait_mpsc_queue[split]"].emplace_back(time);
+            }
+            else if (count % kNumberOfQueues == 8)
+            {
+
+                auto time =
+                    benchmark_multi_thread<split_spin_queue<std::uint64_t>>(_threads, _elements);
+                times_["spin_mpsc_queue[split]"].emplace_back(time);
+            }
+            else if (count % kNumberOfQueues == 9)
+            {
+
+                auto time = benchmark_multi_thread<wait_mpsc_queue<std::uint64_t>, 64>(
+                    _threads,
+                    _elements);
+                times_["wait_mpsc_queue[bulk 64]"].emplace_back(time);
+            }
+            else if (count % kNumberOfQueues == 10)
+            {
+
+                auto time =
+                    benchmark_multi_thread<relaxed_wait_queue<std::uint64_t>>(_threads, _elements);
+                times_["wait_mpsc_queue[relaxed]"].emplace_back(time);
+            }
+            else if (count % kNumberOfQueues == 11)
+            {
+
+                auto time =
+                    benchmark_multi_thread<relaxed_spin_queue<std::uint64_t>>(_threads, _elements);
+                times_["spin_mpsc_queue[relaxed]"].emplace_back(time);
+            }
+            else if (count % kNumberOfQueues == 12)
+            {
+
+                auto time = benchmark_multi_thread<timestamp_wait_queue<std::uint64_t>>(
+                    _threads,
+                    _elements);
+                times_["wait_mpsc_queue[timestamp]"].emplace_back(time);
+            }
 
             ++count;
         }
@@ -162,21 +524,21 @@ namespace zib::benchmark {
         return count;
     }
 
-    template <typename Queue>
+    template <typename Queue, std::size_t Batch>
     std::size_t
-    benchmark_multi_thread(std::size_t _threads, std::size_t _elements)
+    benchmark_multi_thread(
+        std::size_t                _threads,
+        std::size_t                _elements,
+        std::pmr::memory_resource* _resource)
     {
 
-        static constexpr bool is_overflow =
-            std::is_same_v<Queue, overflow_mpsc_queue<typename Queue::value_type>>;
-
         static constexpr bool has_less = std::is_same_v<LessMarker, typename Queue::value_type>;
 
         auto queue_threads = _threads;
         if constexpr (has_less) { queue_threads = (_threads * 2 / 3); }
 
         std::vector<std::jthread> threads(_threads);
-        Queue                     queue(queue_threads);
+        Queue                     queue = make_queue<Queue>(queue_threads, _resource);
         std::latch                lch(_threads + 2);
         auto                      number_of_cores = core_count();
 
@@ -188,13 +550,31 @@ namespace zib::benchmark {
                 {
                     lch.arrive_and_wait();
                     using namespace std::chrono_literals;
+
+                    if constexpr (Batch > 1)
+                    {
+                        std::array<typename Queue::value_type, Batch> batch;
+                        for (size_t i = 0; i < _elements; i += Batch)
+                        {
+                            auto size = std::min(Batch, _elements - i);
+                            for (size_t j = 0; j < size; ++j)
+                            {
+                                batch[j] = i + j + (_elements * index);
+                            }
+
+                            queue.enqueue_bulk(std::span(batch).first(size), index - 1);
+                        }
+
+                        return;
+                    }
+
                     for (size_t i = 0; i < _elements; ++i)
                     {
                         if constexpr (has_less) {
 
                             queue.safe_enqueue(LessMarker{i + (_elements * index)}, index - 1);
 
-                        } else if constexpr (is_overflow)
+                        } else if constexpr (is_overflow<Queue>)
                         {
                             queue.safe_enqueue(i + (_elements * index), index - 1);
                         } 
@@ -222,9 +602,7 @@ namespace zib::benchmark {
                 size_t amount = 0;
                 while (amount != _elements * _threads)
                 {
-                    if constexpr (
-                        std::is_same_v<Queue, wait_mpsc_queue<typename Queue::value_type>> ||
-                        is_overflow)
+                    if constexpr (is_blocking<Queue>)
                     {
                         queue.dequeue();
                         ++amount;
@@ -261,6 +639,146 @@ namespace zib::benchmark {
         return total_time;
     }
 
+    template <typename Queue>
+    std::size_t
+    benchmark_lanes(std::size_t _lanes, std::size_t _producers, std::size_t _elements)
+    {
+        std::vector<std::jthread> threads(_producers);
+        Queue                     queue(_lanes);
+        std::latch                lch(_producers + 2);
+        auto                      number_of_cores = core_count();
+
+        size_t index = 1;
+        for (auto& t : threads)
+        {
+            /* Spread the producers so the idle lanes sit between them */
+            std::uint16_t t_id = (index - 1) * _lanes / _producers;
+
+            t = std::jthread(
+                [&, index, t_id]()
+                {
+                    lch.arrive_and_wait();
+                    for (size_t i = 0; i < _elements; ++i)
+                    {
+                        queue.enqueue(i + (_elements * index), t_id);
+                    }
+                });
+
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(index % number_of_cores, &cpuset);
+            int rc = pthread_setaffinity_np(t.native_handle(), sizeof(cpu_set_t), &cpuset);
+            if (rc != 0) { std::cerr << "Error calling pthread_setaffinity_np: " << rc << "\n"; }
+
+            ++index;
+        }
+
+        std::jthread executer(
+            [&]()
+            {
+                lch.arrive_and_wait();
+                for (size_t amount = 0; amount != _elements * _producers; ++amount)
+                {
+                    queue.dequeue();
+                }
+            });
+
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(0, &cpuset);
+        int rc = pthread_setaffinity_np(executer.native_handle(), sizeof(cpu_set_t), &cpuset);
+        if (rc != 0) { std::cerr << "Error calling pthread_setaffinity_np: " << rc << "\n"; }
+
+        auto start = std::chrono::high_resolution_clock::now();
+        lch.arrive_and_wait();
+
+        if (executer.joinable()) { executer.join(); }
+
+        auto end = std::chrono::high_resolution_clock::now();
+
+        for (auto& t : threads)
+        {
+            if (t.joinable()) { t.join(); }
+        }
+
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    }
+
+    /* The average time a producer spends in its enqueues, with the consumer draining the
+     * queue alongside
+     */
+    template <typename Queue>
+    std::size_t
+    benchmark_enqueue(std::size_t _lanes, std::size_t _producers, std::size_t _elements)
+    {
+        std::vector<std::jthread>  threads(_producers);
+        std::vector<std::uint64_t> times(_producers, 0);
+        Queue                      queue(_lanes);
+        std::latch                 lch(_producers + 1);
+        auto                       number_of_cores = core_count();
+
+        size_t index = 1;
+        for (auto& t : threads)
+        {
+            std::uint16_t t_id = (index - 1) * _lanes / _producers;
+
+            t = std::jthread(
+                [&, index, t_id]()
+                {
+                    lch.arrive_and_wait();
+
+                    auto start = std::chrono::high_resolution_clock::now();
+                    for (size_t i = 0; i < _elements; ++i)
+                    {
+                        queue.enqueue(i + (_elements * index), t_id);
+                    }
+                    auto end = std::chrono::high_resolution_clock::now();
+
+                    times[index - 1] =
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+                });
+
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(index % number_of_cores, &cpuset);
+            int rc = pthread_setaffinity_np(t.native_handle(), sizeof(cpu_set_t), &cpuset);
+            if (rc != 0) { std::cerr << "Error calling pthread_setaffinity_np: " << rc << "\n"; }
+
+            ++index;
+        }
+
+        std::jthread executer(
+            [&]()
+            {
+                lch.arrive_and_wait();
+                for (size_t amount = 0; amount != _elements * _producers; ++amount)
+                {
+                    queue.dequeue();
+                }
+            });
+
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(0, &cpuset);
+        int rc = pthread_setaffinity_np(executer.native_handle(), sizeof(cpu_set_t), &cpuset);
+        if (rc != 0) { std::cerr << "Error calling pthread_setaffinity_np: " << rc << "\n"; }
+
+        if (executer.joinable()) { executer.join(); }
+
+        for (auto& t : threads)
+        {
+            if (t.joinable()) { t.join(); }
+        }
+
+        std::uint64_t total = 0;
+        for (auto time : times)
+        {
+            total += time;
+        }
+
+        return total / _producers;
+    }
+
 }   // namespace zib::benchmark
 
 int
@@ -272,6 +790,18 @@ main()
         zib::benchmark::run_benchmarks(i, 1000000);
     }
 
+    std::cout << "\nTest with 8 threads over more lanes\n";
+    zib::benchmark::run_lane_benchmarks(8, 1000000);
+
+    std::cout << "\nTest with 8 threads, the producers' cost of the active lane bitmap\n";
+    zib::benchmark::run_active_benchmarks(8, 1000000);
+
+    std::cout << "\nTest with 8 threads over stamp blocks\n";
+    zib::benchmark::run_block_benchmarks(8, 1000000);
+
+    std::cout << "\nTest with 8 threads with and without a hugepage arena\n";
+    zib::benchmark::run_hugepage_benchmarks(8, 1000000);
+
     return 0;
 }
 
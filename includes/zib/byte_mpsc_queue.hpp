@@ -0,0 +1,635 @@
+/*
+ * [....... [..[..[.. [..
+ *        [..  [..[.    [..
+ *       [..   [..[.     [..
+ *     [..     [..[... [.
+ *    [..      [..[.     [..
+ *  [..        [..[.      [.
+ * [...........[..[.... [..
+ *
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Donald-Rupin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ *
+ *  @file byte_mpsc_queue.hpp
+ *
+ */
+
+#ifndef ZIB_BYTE_MPSC_QUEUE_HPP_
+#define ZIB_BYTE_MPSC_QUEUE_HPP_
+
+#include <algorithm>
+#include <assert.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+namespace zib {
+
+    namespace byte_details {
+
+        /* Shamelssly takend from
+         * https://en.cppreference.com/w/cpp/thread/hardware_destructive_interference_size
+         * as in some c++ libraries it doesn't exists
+         */
+#ifdef __cpp_lib_hardware_interference_size
+        using std::hardware_constructive_interference_size;
+        using std::hardware_destructive_interference_size;
+#else
+        // 64 bytes on x86-64 │ L1_CACHE_BYTES │ L1_CACHE_SHIFT │ __cacheline_aligned │
+        // ...
+        constexpr std::size_t hardware_constructive_interference_size =
+            2 * sizeof(std::max_align_t);
+        constexpr std::size_t hardware_destructive_interference_size = 2 * sizeof(std::max_align_t);
+#endif
+
+        /* Allocates on cache line boundaries from a memory resource, so consumer only arrays don't
+         * share a line with anything a producer writes.
+         */
+        template <typename T>
+        struct cache_aligned_allocator {
+
+                using value_type = T;
+
+                /* Whole lines, so the last isn't shared with whatever is allocated next */
+                static constexpr auto kLine = hardware_destructive_interference_size;
+
+                cache_aligned_allocator(
+                    std::pmr::memory_resource* _resource = std::pmr::new_delete_resource()) noexcept
+                    : resource_(_resource)
+                { }
+
+                template <typename U>
+                cache_aligned_allocator(const cache_aligned_allocator<U>& _other) noexcept
+                    : resource_(_other.resource_)
+                { }
+
+                T*
+                allocate(std::size_t _n)
+                {
+                    return static_cast<T*>(resource_->allocate(bytes(_n), kLine));
+                }
+
+                void
+                deallocate(T* _ptr, std::size_t _n) noexcept
+                {
+                    resource_->deallocate(_ptr, bytes(_n), kLine);
+                }
+
+                static std::size_t
+                bytes(std::size_t _n) noexcept
+                {
+                    return (_n * sizeof(T) + kLine - 1) / kLine * kLine;
+                }
+
+                template <typename U>
+                bool
+                operator==(const cache_aligned_allocator<U>& _other) const noexcept
+                {
+                    return *resource_ == *_other.resource_;
+                }
+
+                std::pmr::memory_resource* resource_;
+        };
+
+        /* Finds the smallest stamp in _stamps, the lowest index wins a tie.
+         * Returns {max, -1} if every stamp is the empty marker (max).
+         */
+        inline std::pair<std::uint64_t, std::int64_t>
+        min_stamp(const std::uint64_t* _stamps, std::size_t _size) noexcept
+        {
+            auto         min_count = std::numeric_limits<std::uint64_t>::max();
+            std::int64_t min_index = -1;
+
+            for (std::size_t i = 0; i < _size; ++i)
+            {
+                if (_stamps[i] < min_count)
+                {
+                    min_count = _stamps[i];
+                    min_index = i;
+                }
+            }
+
+            return {min_count, min_index};
+        }
+
+        static constexpr std::size_t kDefaultMPSCByteSize             = 64 * 1024;
+        static constexpr std::size_t kDefaultMPSCAllocationBufferSize = 16;
+
+    }   // namespace byte_details
+
+    /* A queue of variable length byte records. Each producer's lane is a linked list of byte
+     * buffers, written front to back like a bip-buffer: a record that doesn't fit in what is left
+     * of a buffer goes at the start of the next one, so every record is contiguous. Records are
+     * stamped and taken in the same order as the spin_mpsc_queue's elements.
+     */
+    template <
+        std::size_t BufferSize     = byte_details::kDefaultMPSCByteSize,
+        std::size_t AllocationSize = byte_details::kDefaultMPSCAllocationBufferSize>
+    class byte_mpsc_queue {
+
+        private:
+
+            static constexpr auto kEmpty = std::numeric_limits<std::uint64_t>::max();
+
+            /* The stamp of the record after a buffer's last: the lane goes on in the next buffer */
+            static constexpr auto kWrap = kEmpty - 1;
+
+            static constexpr auto kAlignment = byte_details::hardware_destructive_interference_size;
+
+            /* Records start on max_align_t boundaries, so a payload can be read in place */
+            static constexpr std::size_t kRecordAlignment = alignof(std::max_align_t);
+
+            /* Precedes every payload. The stamp is published last, the size is read after it */
+            struct record {
+
+                    explicit record(std::uint64_t _count) : count_(_count), size_(0) { }
+
+                    std::atomic<std::uint64_t> count_;
+                    std::uint64_t              size_;
+            };
+
+            static_assert(sizeof(record) % kRecordAlignment == 0, "record breaks the alignment");
+
+            static_assert(
+                BufferSize % kRecordAlignment == 0 && BufferSize >= 4 * sizeof(record),
+                "BufferSize is out of range");
+
+            struct alignas(kAlignment) node_buffer {
+
+                    node_buffer() : read_head_(0), next_(nullptr), write_head_(0)
+                    {
+                        std::construct_at(reinterpret_cast<record*>(data_), kEmpty);
+                    }
+
+                    node_buffer(const node_buffer&) = delete;
+
+                    node_buffer&
+                    operator=(const node_buffer&) = delete;
+
+                    /* Ready for another pass of the lane, the first record read as unwritten */
+                    void
+                    recycle() noexcept
+                    {
+                        read_head_  = 0;
+                        next_       = nullptr;
+                        write_head_ = 0;
+                        std::construct_at(reinterpret_cast<record*>(data_), kEmpty);
+                    }
+
+                    /* The record at _offset, which has been constructed as at least kEmpty */
+                    record*
+                    at(std::size_t _offset) noexcept
+                    {
+                        return std::launder(reinterpret_cast<record*>(data_ + _offset));
+                    }
+
+                    std::byte*
+                    payload(std::size_t _offset) noexcept
+                    {
+                        return data_ + _offset + sizeof(record);
+                    }
+
+                    std::size_t read_head_ alignas(kAlignment);
+
+                    node_buffer* next_ alignas(kAlignment);
+
+                    std::size_t write_head_ alignas(kAlignment);
+
+                    alignas(kAlignment) std::byte data_[BufferSize];
+            };
+
+            struct alignas(kAlignment) allocation_pool {
+
+                    /* Running counts, the slot is the count modulo AllocationSize */
+                    std::atomic<std::uint64_t> read_count_ alignas(kAlignment);
+
+                    std::atomic<std::uint64_t> write_count_ alignas(kAlignment);
+
+                    struct alignas(kAlignment) aligned_ptr {
+                            node_buffer* ptr_;
+                    };
+
+                    aligned_ptr items_[AllocationSize];
+
+                    /* Consumer only. False if the ring is full, the buffer is left as it was */
+                    bool
+                    push(node_buffer* _ptr) noexcept
+                    {
+                        auto write_idx = write_count_.load(std::memory_order_relaxed);
+
+                        /* Full, it holds up to AllocationSize - 1 buffers */
+                        if (write_idx - read_count_.load(std::memory_order_acquire) ==
+                            AllocationSize - 1)
+                        {
+                            return false;
+                        }
+
+                        _ptr->recycle();
+
+                        items_[write_idx % AllocationSize].ptr_ = _ptr;
+
+                        write_count_.store(write_idx + 1, std::memory_order_release);
+
+                        return true;
+                    }
+
+                    /* Producer only. nullptr if the consumer hasn't handed a buffer back */
+                    node_buffer*
+                    pop() noexcept
+                    {
+                        auto read_idx = read_count_.load(std::memory_order_relaxed);
+                        if (read_idx == write_count_.load(std::memory_order_acquire))
+                        {
+                            return nullptr;
+                        }
+
+                        auto* tmp = items_[read_idx % AllocationSize].ptr_;
+
+                        read_count_.store(read_idx + 1, std::memory_order_release);
+
+                        return tmp;
+                    }
+            };
+
+            /* Everything a producer writes, on lines of its own */
+            struct alignas(kAlignment) producer_block {
+
+                    producer_block() : tail_(nullptr), prepared_(0), first_(nullptr) { }
+
+                    /* Allocates the lane's first buffer on the producer's thread and publishes it
+                     * to the consumer
+                     */
+                    void
+                    start(std::pmr::polymorphic_allocator<> _allocator)
+                    {
+                        tail_ = next_buffer(_allocator);
+                        first_.store(tail_, std::memory_order_release);
+                    }
+
+                    /* The next buffer of the lane, recycled if the consumer has handed one back */
+                    node_buffer*
+                    next_buffer(std::pmr::polymorphic_allocator<> _allocator)
+                    {
+                        if (auto* buffer = pool_.pop()) { return buffer; }
+
+                        return _allocator.new_object<node_buffer>();
+                    }
+
+                    node_buffer* tail_;
+
+                    /* The size of the record prepare() last made room for */
+                    std::size_t prepared_;
+
+                    /* The lane's first buffer, nullptr until the producer starts the lane */
+                    std::atomic<node_buffer*> first_;
+
+                    allocation_pool pool_;
+            };
+
+            using stamp_mirror =
+                std::vector<std::uint64_t, byte_details::cache_aligned_allocator<std::uint64_t>>;
+
+            using producer_list =
+                std::vector<producer_block, byte_details::cache_aligned_allocator<producer_block>>;
+
+            using buffer_list =
+                std::vector<node_buffer*, byte_details::cache_aligned_allocator<node_buffer*>>;
+
+        public:
+
+            /* The largest record a lane can hold. There is always room left in a buffer for the
+             * record after it, so the lane can be wrapped.
+             */
+            static constexpr std::size_t
+            max_size() noexcept
+            {
+                return BufferSize - 2 * sizeof(record);
+            }
+
+            byte_mpsc_queue(
+                std::uint64_t              _num_threads,
+                std::pmr::memory_resource* _resource = std::pmr::new_delete_resource())
+                : allocator_(_resource), heads_(_num_threads, _resource),
+                  stamps_(std::max<std::size_t>(_num_threads, 1), kEmpty, _resource),
+                  peeked_(false), peek_index_(0), producers_(_num_threads, _resource), up_to_(0)
+            { }
+
+            ~byte_mpsc_queue()
+            {
+                /* Lanes started since the consumer last looked at them */
+                for (std::size_t i = 0; i < heads_.size(); ++i)
+                {
+                    lane_head(i);
+                }
+
+                for (auto h : heads_)
+                {
+                    while (h)
+                    {
+                        auto tmp = h->next_;
+                        allocator_.delete_object(h);
+                        h = tmp;
+                    }
+                }
+
+                for (auto& p : producers_)
+                {
+                    while (auto* to_delete = p.pool_.pop())
+                    {
+                        allocator_.delete_object(to_delete);
+                    }
+                }
+            }
+
+            /* Copies _data into a record at the tail of lane _t_id. False, with nothing
+             * enqueued, if it is longer than max_size().
+             */
+            bool
+            enqueue(std::span<const std::byte> _data, std::uint16_t _t_id) noexcept
+            {
+                auto out = prepare(_t_id, _data.size());
+                if (!out.data()) { return false; }
+
+                if (!_data.empty()) { std::memcpy(out.data(), _data.data(), _data.size()); }
+
+                commit(_t_id);
+                return true;
+            }
+
+            /* Makes room for a record of _size bytes at the tail of lane _t_id, for the producer
+             * to serialise into in place. The producer can't enqueue on the lane again until it
+             * has committed. A span without data() if _size is over max_size(), with nothing
+             * to commit.
+             */
+            std::span<std::byte>
+            prepare(std::uint16_t _t_id, std::size_t _size) noexcept
+            {
+                if (_size > max_size()) { return {}; }
+
+                auto& producer = producers_[_t_id];
+                if (!producer.tail_) { producer.start(allocator_); }
+
+                auto* buffer = producer.tail_;
+                if (buffer->write_head_ + record_bytes(_size) > BufferSize - sizeof(record))
+                {
+                    auto* next    = producer.next_buffer(allocator_);
+                    buffer->next_ = next;
+                    buffer->at(buffer->write_head_)->count_.store(kWrap, std::memory_order_release);
+
+                    producer.tail_ = buffer = next;
+                }
+
+                producer.prepared_ = _size;
+
+                return {buffer->payload(buffer->write_head_), _size};
+            }
+
+            /* Stamps the record prepare() made room for, handing it to the consumer */
+            void
+            commit(std::uint16_t _t_id) noexcept
+            {
+                commit(_t_id, producers_[_t_id].prepared_);
+            }
+
+            /* Stamps the record prepare() made room for cut down to its first _size bytes, for
+             * when the producer doesn't know how long it is until it has written it
+             */
+            void
+            commit(std::uint16_t _t_id, std::size_t _size) noexcept
+            {
+                auto& producer = producers_[_t_id];
+                auto* buffer   = producer.tail_;
+
+                assert(_size <= producer.prepared_);
+
+                auto* current = buffer->at(buffer->write_head_);
+                current->size_ = _size;
+
+                /* The consumer stops at the next record until this one is stamped */
+                buffer->write_head_ += record_bytes(_size);
+                std::construct_at(buffer->at(buffer->write_head_), kEmpty);
+
+                auto cur = up_to_.load(std::memory_order_acquire);
+
+                current->count_.store(cur, std::memory_order_release);
+
+                if (cur == up_to_.load(std::memory_order_acquire))
+                {
+                    up_to_.fetch_add(1, std::memory_order_release);
+                }
+            }
+
+            /* The record that would be taken next, left where it is, or std::nullopt if the queue
+             * is empty. It stays at the front until pop() or the next consume_all() takes it.
+             */
+            std::optional<std::span<const std::byte>>
+            peek() noexcept
+            {
+                if (!peeked_)
+                {
+                    auto index = next();
+                    if (index < 0) { return std::nullopt; }
+
+                    peeked_     = true;
+                    peek_index_ = index;
+                }
+
+                return front(peek_index_);
+            }
+
+            /* Moves on from the record peek() returned, nothing if there isn't one. Its buffer is
+             * handed back once the consumer is done with it.
+             */
+            void
+            pop() noexcept
+            {
+                if (!peeked_) { return; }
+
+                peeked_ = false;
+                release(peek_index_);
+            }
+
+            /* Calls _callback with every record that is available, in stamp order, and returns
+             * how many there were. A record left by peek() comes first. A record's bytes are only
+             * valid for the length of its call.
+             */
+            template <typename Callback>
+            std::size_t
+            consume_all(Callback&& _callback) noexcept(
+                noexcept(_callback(std::declval<std::span<const std::byte>>())))
+            {
+                std::size_t taken = 0;
+                if (peeked_)
+                {
+                    peeked_ = false;
+                    _callback(front(peek_index_));
+                    release(peek_index_);
+
+                    ++taken;
+                }
+
+                while (true)
+                {
+                    auto index = next();
+                    if (index < 0) { break; }
+
+                    _callback(front(index));
+                    release(index);
+
+                    ++taken;
+                }
+
+                return taken;
+            }
+
+        private:
+
+            /* The bytes a record of _size takes up, its header included */
+            static constexpr std::size_t
+            record_bytes(std::size_t _size) noexcept
+            {
+                return sizeof(record) +
+                       (_size + kRecordAlignment - 1) / kRecordAlignment * kRecordAlignment;
+            }
+
+            /* The lane to take from next, -1 if there is nothing to take. Two scans have to agree
+             * on the lane holding the smallest stamp.
+             */
+            std::int64_t
+            next() noexcept
+            {
+                std::int64_t prev_index = -2;
+                while (true)
+                {
+                    refresh_empty();
+
+                    auto min_index = byte_details::min_stamp(stamps_.data(), stamps_.size()).second;
+                    if (prev_index == min_index) { return min_index; }
+
+                    prev_index = min_index;
+                }
+            }
+
+            /* The payload of the record at the head of a lane */
+            std::span<const std::byte>
+            front(std::size_t _index) noexcept
+            {
+                auto* head = heads_[_index];
+
+                return {head->payload(head->read_head_), head->at(head->read_head_)->size_};
+            }
+
+            /* Moves a lane on past the record at its head */
+            void
+            release(std::size_t _index) noexcept
+            {
+                auto* head = heads_[_index];
+                head->read_head_ += record_bytes(head->at(head->read_head_)->size_);
+
+                refresh(_index);
+            }
+
+            /* The buffer at the head of a lane, nullptr until its producer has started it */
+            node_buffer*
+            lane_head(std::size_t _index) noexcept
+            {
+                if (!heads_[_index])
+                {
+                    heads_[_index] = producers_[_index].first_.load(std::memory_order_acquire);
+                }
+
+                return heads_[_index];
+            }
+
+            /* An emptied buffer goes back to its lane's pool, deleted if that is full */
+            void
+            hand_back(std::size_t _index, node_buffer* _buffer) noexcept
+            {
+                if (!producers_[_index].pool_.push(_buffer)) { allocator_.delete_object(_buffer); }
+            }
+
+            /* The stamp at the head of a non-empty lane can only change when the consumer takes
+             * it, so only the lanes the mirror has as empty need to be read again.
+             */
+            void
+            refresh_empty() noexcept
+            {
+                for (std::size_t i = 0; i < heads_.size(); ++i)
+                {
+                    if (stamps_[i] == kEmpty) { refresh(i); }
+                }
+            }
+
+            /* Reads the stamp at the head of a lane, following it into its next buffer past the
+             * end of the last
+             */
+            void
+            refresh(std::size_t _index) noexcept
+            {
+                auto* head  = lane_head(_index);
+                auto  count = kEmpty;
+
+                while (head)
+                {
+                    count = head->at(head->read_head_)->count_.load(std::memory_order_acquire);
+                    if (count != kWrap) { break; }
+
+                    heads_[_index] = head->next_;
+                    hand_back(_index, head);
+                    head = heads_[_index];
+                }
+
+                stamps_[_index] = count;
+            }
+
+            /* Where the buffers and arrays come from, read only */
+            std::pmr::polymorphic_allocator<> allocator_;
+
+            /* Consumer only */
+            buffer_list heads_ alignas(kAlignment);
+
+            /* Consumer side mirror of the stamp at the head of each lane */
+            stamp_mirror stamps_;
+
+            /* The record peek() found, until pop() moves on from it */
+            bool         peeked_;
+            std::int64_t peek_index_;
+
+            producer_list              producers_ alignas(kAlignment);
+            std::atomic<std::uint64_t> up_to_ alignas(kAlignment);
+            char                        padding_[kAlignment - sizeof(up_to_)];
+    };
+
+}   // namespace zib
+
+#endif /* ZIB_BYTE_MPSC_QUEUE_HPP_ */
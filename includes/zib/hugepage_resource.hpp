@@ -0,0 +1,265 @@
+/*
+ * [....... [..[..[.. [..
+ *        [..  [..[.    [..
+ *       [..   [..[.     [..
+ *     [..     [..[... [.
+ *    [..      [..[.     [..
+ *  [..        [..[.      [.
+ * [...........[..[.... [..
+ *
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Donald-Rupin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ *
+ *  @file hugepage_resource.hpp
+ *
+ */
+
+#ifndef ZIB_HUGEPAGE_RESOURCE_HPP_
+#define ZIB_HUGEPAGE_RESOURCE_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <mutex>
+#include <vector>
+
+#if defined(__linux__)
+    #include <sys/mman.h>
+#endif
+
+namespace zib {
+
+    /* A memory resource that carves allocations out of one region backed by 2 MB pages. A
+     * node_buffer spans dozens of 4 KB pages, so with the region on huge pages the producers and
+     * the consumer walking the buffers need a fraction of the TLB entries.
+     *
+     * The region is mapped with MAP_HUGETLB, which needs hugepages reserved up front
+     * (vm.nr_hugepages). Failing that it is mapped 2 MB aligned and advised MADV_HUGEPAGE for
+     * transparent hugepages. Allocations that don't fit, or every allocation off Linux, go to the
+     * upstream resource. Freed blocks are kept on a list per size, so a recycled buffer's memory
+     * goes to the next buffer of the same size.
+     *
+     * Safe to share between the producers and the consumer.
+     */
+    class hugepage_resource : public std::pmr::memory_resource {
+
+        public:
+
+            static constexpr std::size_t kHugePageSize = 2 * 1024 * 1024;
+
+            /* What the region ended up backed by */
+            enum class backing {
+                kHugeTLB,
+                kTransparent,
+                kSmallPages,
+                kUpstream
+            };
+
+            explicit hugepage_resource(
+                std::size_t                _bytes,
+                std::pmr::memory_resource* _upstream = std::pmr::new_delete_resource())
+                : upstream_(_upstream), size_(round_up(_bytes, kHugePageSize)), used_(0),
+                  region_(nullptr), backing_(backing::kUpstream)
+            {
+                map();
+            }
+
+            hugepage_resource(const hugepage_resource&) = delete;
+
+            hugepage_resource&
+            operator=(const hugepage_resource&) = delete;
+
+            ~hugepage_resource()
+            {
+#if defined(__linux__)
+                if (region_) { munmap(region_, size_); }
+#endif
+            }
+
+            /* Enough for every lane of a Queue to hold _buffers_per_lane buffers, plus a page for
+             * the queue's own arrays.
+             */
+            template <typename Queue>
+            static std::size_t
+            bytes_for(std::size_t _lanes, std::size_t _buffers_per_lane = 4) noexcept
+            {
+                return _lanes * _buffers_per_lane * Queue::buffer_bytes() + kHugePageSize;
+            }
+
+            backing
+            kind() const noexcept
+            {
+                return backing_;
+            }
+
+        private:
+
+            /* The head of a list of freed blocks of one size, linked through their first word */
+            struct free_list {
+                    std::size_t bytes_;
+                    void*       head_;
+            };
+
+            static std::size_t
+            round_up(std::size_t _value, std::size_t _to) noexcept
+            {
+                return (_value + _to - 1) / _to * _to;
+            }
+
+            void
+            map() noexcept
+            {
+#if defined(__linux__)
+                auto* ptr = mmap(
+                    nullptr,
+                    size_,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                    -1,
+                    0);
+
+                if (ptr != MAP_FAILED)
+                {
+                    region_  = static_cast<std::byte*>(ptr);
+                    backing_ = backing::kHugeTLB;
+                    return;
+                }
+
+                /* Transparent hugepages only back 2 MB aligned ranges, so map a page more than
+                 * needed and trim either end.
+                 */
+                ptr = mmap(
+                    nullptr,
+                    size_ + kHugePageSize,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1,
+                    0);
+
+                if (ptr == MAP_FAILED) { return; }
+
+                auto start   = reinterpret_cast<std::uintptr_t>(ptr);
+                auto aligned = round_up(start, kHugePageSize);
+
+                if (aligned != start) { munmap(ptr, aligned - start); }
+                if (aligned != start + kHugePageSize)
+                {
+                    munmap(
+                        reinterpret_cast<void*>(aligned + size_),
+                        start + kHugePageSize - aligned);
+                }
+
+                region_  = reinterpret_cast<std::byte*>(aligned);
+                backing_ = madvise(region_, size_, MADV_HUGEPAGE) == 0 ? backing::kTransparent
+                                                                       : backing::kSmallPages;
+#endif
+            }
+
+            bool
+            owns(void* _ptr) const noexcept
+            {
+                auto* ptr = static_cast<std::byte*>(_ptr);
+
+                return region_ && ptr >= region_ && ptr < region_ + size_;
+            }
+
+            void*
+            do_allocate(std::size_t _bytes, std::size_t _alignment) override
+            {
+                /* Freed blocks hold the free list's link */
+                auto bytes = std::max(_bytes, sizeof(void*));
+
+                {
+                    std::lock_guard lock(mutex_);
+
+                    for (auto& list : free_)
+                    {
+                        if (list.bytes_ == bytes && list.head_ &&
+                            reinterpret_cast<std::uintptr_t>(list.head_) % _alignment == 0)
+                        {
+                            auto* block = list.head_;
+                            list.head_  = *static_cast<void**>(block);
+                            return block;
+                        }
+                    }
+
+                    auto offset = round_up(used_, _alignment);
+                    if (region_ && offset + bytes <= size_)
+                    {
+                        used_ = offset + bytes;
+                        return region_ + offset;
+                    }
+                }
+
+                return upstream_->allocate(_bytes, _alignment);
+            }
+
+            void
+            do_deallocate(void* _ptr, std::size_t _bytes, std::size_t _alignment) override
+            {
+                if (!owns(_ptr))
+                {
+                    upstream_->deallocate(_ptr, _bytes, _alignment);
+                    return;
+                }
+
+                auto bytes = std::max(_bytes, sizeof(void*));
+
+                std::lock_guard lock(mutex_);
+
+                for (auto& list : free_)
+                {
+                    if (list.bytes_ == bytes)
+                    {
+                        *static_cast<void**>(_ptr) = list.head_;
+                        list.head_                 = _ptr;
+                        return;
+                    }
+                }
+
+                *static_cast<void**>(_ptr) = nullptr;
+                free_.push_back(free_list{bytes, _ptr});
+            }
+
+            bool
+            do_is_equal(const std::pmr::memory_resource& _other) const noexcept override
+            {
+                return this == &_other;
+            }
+
+            std::pmr::memory_resource* upstream_;
+
+            std::size_t size_;
+            std::size_t used_;
+            std::byte*  region_;
+            backing     backing_;
+
+            std::mutex             mutex_;
+            std::vector<free_list> free_;
+    };
+
+}   // namespace zib
+
+#endif /* ZIB_HUGEPAGE_RESOURCE_HPP_ */
@@ -38,14 +38,33 @@
 #ifndef ZIB_SPIN_OVERFLOW_MPSC_QUEUE_HPP_
 #define ZIB_SPIN_OVERFLOW_MPSC_QUEUE_HPP_
 
+#include <algorithm>
 #include <assert.h>
 #include <atomic>
+#include <bit>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <limits>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
 #include <optional>
+#include <span>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#if defined(__AVX2__) || defined(__SSE4_2__)
+    #include <immintrin.h>
+#endif
+
+#if defined(__linux__)
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
 namespace zib {
 
     namespace spin_overflow_details {
@@ -84,356 +103,2481 @@ namespace zib {
                 operator()(T*) const noexcept {};
         };
 
-        static constexpr std::size_t kDefaultMPSCSize                 = 4096;
-        static constexpr std::size_t kDefaultMPSCAllocationBufferSize = 16;
-
-    }   // namespace spin_overflow_details
+        /* Allocates on cache line boundaries from a memory resource, so consumer only arrays don't
+         * share a line with anything a producer writes and vector loads never split a line.
+         */
+        template <typename T>
+        struct cache_aligned_allocator {
 
-    template <
-        typename T,
-        spin_overflow_details::Deconstructor<T> F = spin_overflow_details::deconstruct_noop<T>,
-        std::size_t BufferSize                    = spin_overflow_details::kDefaultMPSCSize,
-        std::size_t AllocationSize = spin_overflow_details::kDefaultMPSCAllocationBufferSize>
-    class spin_overflow_mpsc_queue {
+                using value_type = T;
 
-        private:
+                /* Whole lines, so the last isn't shared with whatever is allocated next */
+                static constexpr auto kLine = hardware_destructive_interference_size;
 
-            static constexpr auto kEmpty   = std::numeric_limits<std::size_t>::max();
-            static constexpr auto kUnknown = std::numeric_limits<std::size_t>::max();
+                cache_aligned_allocator(
+                    std::pmr::memory_resource* _resource = std::pmr::new_delete_resource()) noexcept
+                    : resource_(_resource)
+                { }
 
-            static constexpr auto kAlignment =
-                spin_overflow_details::hardware_destructive_interference_size;
+                template <typename U>
+                cache_aligned_allocator(const cache_aligned_allocator<U>& _other) noexcept
+                    : resource_(_other.resource_)
+                { }
 
-            struct alignas(kAlignment) node {
+                T*
+                allocate(std::size_t _n)
+                {
+                    return static_cast<T*>(resource_->allocate(bytes(_n), kLine));
+                }
 
-                    node() : count_(kEmpty) { }
+                void
+                deallocate(T* _ptr, std::size_t _n) noexcept
+                {
+                    resource_->deallocate(_ptr, bytes(_n), kLine);
+                }
 
-                    T data_;
+                static std::size_t
+                bytes(std::size_t _n) noexcept
+                {
+                    return (_n * sizeof(T) + kLine - 1) / kLine * kLine;
+                }
 
-                    std::atomic<std::uint64_t> count_;
-            };
+                template <typename U>
+                bool
+                operator==(const cache_aligned_allocator<U>& _other) const noexcept
+                {
+                    return *resource_ == *_other.resource_;
+                }
 
-            struct alignas(kAlignment) node_buffer {
+                std::pmr::memory_resource* resource_;
+        };
 
-                    node_buffer() : read_head_(0), next_(nullptr), elements_{}, write_head_(0) { }
+        /* Finds the smallest stamp in _stamps, the lowest index wins a tie.
+         * Returns {max, -1} if every stamp is the empty marker (max).
+         *
+         * There is no unsigned 64 bit compare in AVX2/SSE4.2, so the vector paths flip the sign
+         * bit to map unsigned order onto signed order.
+         */
+        inline std::pair<std::uint64_t, std::int64_t>
+        min_stamp(const std::uint64_t* _stamps, std::size_t _size) noexcept
+        {
+            auto         min_count = std::numeric_limits<std::uint64_t>::max();
+            std::int64_t min_index = -1;
+            std::size_t  i         = 0;
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+    #if defined(__AVX2__)
+            static constexpr std::size_t kWidth = 4;
+            using vec                           = __m256i;
+            const auto set1 = [](std::int64_t _v) { return _mm256_set1_epi64x(_v); };
+            const auto load = [](const std::uint64_t* _p)
+            { return _mm256_loadu_si256(reinterpret_cast<const vec*>(_p)); };
+            const auto store = [](std::int64_t* _p, vec _v)
+            { _mm256_storeu_si256(reinterpret_cast<vec*>(_p), _v); };
+            const auto vxor  = [](vec _a, vec _b) { return _mm256_xor_si256(_a, _b); };
+            const auto vadd  = [](vec _a, vec _b) { return _mm256_add_epi64(_a, _b); };
+            const auto vgt   = [](vec _a, vec _b) { return _mm256_cmpgt_epi64(_a, _b); };
+            const auto blend = [](vec _a, vec _b, vec _m)
+            { return _mm256_blendv_epi8(_a, _b, _m); };
+            vec        index = _mm256_setr_epi64x(0, 1, 2, 3);
+    #else
+            static constexpr std::size_t kWidth = 2;
+            using vec                           = __m128i;
+            const auto set1 = [](std::int64_t _v) { return _mm_set1_epi64x(_v); };
+            const auto load = [](const std::uint64_t* _p)
+            { return _mm_loadu_si128(reinterpret_cast<const vec*>(_p)); };
+            const auto store = [](std::int64_t* _p, vec _v)
+            { _mm_storeu_si128(reinterpret_cast<vec*>(_p), _v); };
+            const auto vxor  = [](vec _a, vec _b) { return _mm_xor_si128(_a, _b); };
+            const auto vadd  = [](vec _a, vec _b) { return _mm_add_epi64(_a, _b); };
+            const auto vgt   = [](vec _a, vec _b) { return _mm_cmpgt_epi64(_a, _b); };
+            const auto blend = [](vec _a, vec _b, vec _m) { return _mm_blendv_epi8(_a, _b, _m); };
+            vec        index = _mm_set_epi64x(1, 0);
+    #endif
+
+            if (_size >= kWidth)
+            {
+                static constexpr auto kSign = std::numeric_limits<std::int64_t>::min();
 
-                    std::size_t read_head_ alignas(kAlignment);
+                const vec bias  = set1(kSign);
+                const vec step  = set1(kWidth);
+                vec       best  = set1(std::numeric_limits<std::int64_t>::max());
+                vec       where = set1(-1);
 
-                    node_buffer* next_ alignas(kAlignment);
+                for (; i + kWidth <= _size; i += kWidth)
+                {
+                    auto value = vxor(load(_stamps + i), bias);
+                    auto less  = vgt(best, value);
+                    best       = blend(best, value, less);
+                    where      = blend(where, index, less);
+                    index      = vadd(index, step);
+                }
 
-                    node elements_[BufferSize];
+                std::int64_t bests[kWidth];
+                std::int64_t wheres[kWidth];
+                store(bests, best);
+                store(wheres, where);
 
-                    std::size_t write_head_ alignas(kAlignment);
-            };
+                for (std::size_t j = 0; j < kWidth; ++j)
+                {
+                    auto count = static_cast<std::uint64_t>(bests[j] ^ kSign);
+                    if (count < min_count || (count == min_count && wheres[j] < min_index))
+                    {
+                        min_count = count;
+                        min_index = wheres[j];
+                    }
+                }
+            }
+#endif
 
-            struct alignas(kAlignment) allocation_pool {
+            for (; i < _size; ++i)
+            {
+                if (_stamps[i] < min_count)
+                {
+                    min_count = _stamps[i];
+                    min_index = i;
+                }
+            }
 
-                    std::atomic<std::uint64_t> read_count_ alignas(kAlignment);
+            return {min_count, min_index};
+        }
+
+        /* How the consumer picks the lane holding the smallest head stamp.
+         *
+         * kLinear:     search every lane's stamp, O(lanes) per dequeue.
+         * kTournament: keep a winner tree over the stamps, only the path of a lane whose stamp
+         *              changed is replayed, O(log lanes) per dequeue. Producers keep the same
+         *              bitmap as kActive, so only lanes written since they were found empty
+         *              are read again.
+         * kActive:     producers set a lane's bit in a bitmap when it goes from empty to written
+         *              and the consumer clears it when it finds the lane drained, so only the
+         *              lanes with something in them are searched. An enqueue only checks a
+         *              flag, the consumer pays for a process wide fence to clear bits in a
+         *              batch. Without membarrier, lanes stay in the bitmap once written.
+         */
+        enum class lane_selection {
+            kLinear,
+            kTournament,
+            kActive
+        };
 
-                    std::atomic<std::uint64_t> write_count_ alignas(kAlignment);
+        /* Winner tree over an external array of stamps. Each internal node holds the index of
+         * the smaller of its children (the lower index on a tie) so the minimum is at the root.
+         * The stamp array must be at least leaves() long.
+         */
+        class tournament_tree {
 
-                    struct alignas(kAlignment) aligned_ptr {
-                            node_buffer* ptr_;
-                    };
+            public:
 
-                    aligned_ptr items_[AllocationSize];
+                tournament_tree(std::size_t _size, std::pmr::memory_resource* _resource)
+                    : leaves_(std::bit_ceil(std::max<std::size_t>(_size, 1))),
+                      nodes_(2 * leaves_, _resource)
+                {
+                    for (std::size_t i = 0; i < leaves_; ++i)
+                    {
+                        nodes_[leaves_ + i] = i;
+                    }
 
-                    void
-                    push(node_buffer* _ptr)
+                    /* Every stamp starts empty, so the left most leaf wins every match */
+                    for (std::size_t i = leaves_ - 1; i > 0; --i)
                     {
-                        auto write_idx = write_count_.load(std::memory_order_relaxed);
+                        nodes_[i] = nodes_[2 * i];
+                    }
+                }
 
-                        if (write_idx + 1 == read_count_.load(std::memory_order_relaxed))
-                        {
-                            delete _ptr;
-                            return;
-                        }
+                std::size_t
+                leaves() const noexcept
+                {
+                    return leaves_;
+                }
 
-                        _ptr->~node_buffer();
-                        new (_ptr) node_buffer();
+                std::uint32_t
+                winner() const noexcept
+                {
+                    return nodes_[1];
+                }
 
-                        items_[write_idx].ptr_ = _ptr;
+                /* Replays every match, for when any of the stamps may have changed */
+                void
+                reset(const std::uint64_t* _stamps) noexcept
+                {
+                    for (std::size_t i = leaves_ - 1; i > 0; --i)
+                    {
+                        auto left  = nodes_[2 * i];
+                        auto right = nodes_[2 * i + 1];
+                        nodes_[i]  = _stamps[right] < _stamps[left] ? right : left;
+                    }
+                }
 
-                        if (write_idx + 1 != AllocationSize)
-                        {
-                            write_count_.store(write_idx + 1, std::memory_order_release);
-                        }
-                        else
-                        {
+                void
+                update(const std::uint64_t* _stamps, std::uint32_t _index) noexcept
+                {
+                    for (auto node = (leaves_ + _index) / 2; node > 0; node /= 2)
+                    {
+                        auto left  = nodes_[2 * node];
+                        auto right = nodes_[2 * node + 1];
+                        auto best  = _stamps[right] < _stamps[left] ? right : left;
 
-                            write_count_.store(0, std::memory_order_release);
-                        }
+                        /* The path above only saw the old winner of this match */
+                        if (nodes_[node] == best && best != _index) { return; }
+
+                        nodes_[node] = best;
                     }
+                }
 
-                    node_buffer*
-                    pop()
-                    {
-                        auto read_idx = read_count_.load(std::memory_order_relaxed);
-                        if (read_idx == write_count_.load(std::memory_order_acquire))
-                        {
-                            return new node_buffer;
-                        }
+            private:
 
-                        auto tmp = items_[read_idx].ptr_;
+                std::size_t leaves_;
 
-                        if (read_idx + 1 != AllocationSize)
-                        {
+                std::vector<std::uint32_t, cache_aligned_allocator<std::uint32_t>> nodes_;
+        };
 
-                            read_count_.store(read_idx + 1, std::memory_order_release);
-                        }
-                        else
-                        {
+        static constexpr std::size_t kDefaultMPSCSize                 = 4096;
+        static constexpr std::size_t kDefaultMPSCAllocationBufferSize = 16;
 
-                            read_count_.store(0, std::memory_order_release);
-                        }
+        /* Lanes are named by a std::uint16_t. Those added at runtime come in segments, the first
+         * kDefaultMPSCLaneSegment long and each one after twice the last.
+         */
+        static constexpr std::size_t kMaxLanes               = std::size_t{1} << 16;
+        static constexpr std::size_t kDefaultMPSCLaneSegment = 8;
 
-                        return tmp;
-                    }
+        /* A lane sized between MinBuffer and BufferSize doubles its next buffer when the last one
+         * filled in under kDefaultMPSCGrowInterval, and halves it when it took over
+         * kDefaultMPSCShrinkInterval
+         */
+        static constexpr std::chrono::microseconds kDefaultMPSCGrowInterval{1000};
+        static constexpr std::chrono::milliseconds kDefaultMPSCShrinkInterval{100};
 
-                    node_buffer*
-                    drain()
-                    {
-                        auto read_idx = read_count_.load(std::memory_order_relaxed);
-                        if (read_idx == write_count_.load(std::memory_order_relaxed))
-                        {
-                            return nullptr;
-                        }
+        /* Asks the kernel to place the whole pages in [_ptr, _ptr + _bytes) on NUMA node _node,
+         * moving any already there. Best effort: off Linux, for a negative node, or where mbind
+         * is refused (a single node machine), the pages stay wherever they are first touched.
+         */
+        inline void
+        prefer_node(void* _ptr, std::size_t _bytes, int _node) noexcept
+        {
+#if defined(__linux__) && defined(SYS_mbind)
+            constexpr int         kPreferred = 1;
+            constexpr unsigned    kMove      = 1 << 1;
+            constexpr std::size_t kMaxNodes  = 1024;
+            constexpr std::size_t kBits      = 8 * sizeof(unsigned long);
 
-                        auto tmp = items_[read_idx].ptr_;
+            if (_node < 0 || static_cast<std::size_t>(_node) >= kMaxNodes) { return; }
 
-                        if (read_idx + 1 != AllocationSize)
-                        {
+            auto page  = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+            auto start = (reinterpret_cast<std::uintptr_t>(_ptr) + page - 1) / page * page;
+            auto end   = (reinterpret_cast<std::uintptr_t>(_ptr) + _bytes) / page * page;
+            if (end <= start) { return; }
 
-                            read_count_.store(read_idx + 1, std::memory_order_relaxed);
-                        }
-                        else
-                        {
+            unsigned long mask[kMaxNodes / kBits] = {};
+            mask[_node / kBits] |= 1ul << (_node % kBits);
 
-                            read_count_.store(0, std::memory_order_relaxed);
-                        }
+            syscall(SYS_mbind, start, end - start, kPreferred, mask, kMaxNodes + 1, kMove);
+#else
+            (void) _ptr;
+            (void) _bytes;
+            (void) _node;
+#endif
+        }
 
-                        return tmp;
-                    }
-            };
+        /* Registers the process for process_fence() the first time it is asked, false where
+         * it can't be: off Linux, or on a kernel without expedited membarrier.
+         */
+        inline bool
+        process_fence_ready() noexcept
+        {
+#if defined(__linux__) && defined(SYS_membarrier)
+            constexpr int kRegisterPrivateExpedited = 1 << 4;
 
-            struct alignas(kAlignment) extra_node {
+            static const bool ready =
+                syscall(SYS_membarrier, kRegisterPrivateExpedited, 0, 0) == 0;
 
-                    extra_node() : next_(nullptr), count_(kEmpty) { }
+            return ready;
+#else
+            return false;
+#endif
+        }
 
-                    extra_node(T _value, std::uint64_t _count)
-                        : next_(nullptr), count_(_count), data_(_value)
-                    { }
+        /* A full fence on every running thread of the process, so the threads it pairs with
+         * only need a compiler barrier. Only once process_fence_ready() is true.
+         */
+        inline void
+        process_fence() noexcept
+        {
+#if defined(__linux__) && defined(SYS_membarrier)
+            constexpr int kPrivateExpedited = 1 << 3;
 
-                    std::atomic<extra_node*> next_ alignas(kAlignment);
+            syscall(SYS_membarrier, kPrivateExpedited, 0, 0);
+#endif
+        }
+
+        /* How a node_buffer lays out its elements.
+         *
+         * kInterleaved: every node is cache aligned, the consumer and producer never share a line
+         *               but each element costs a full cache line.
+         * kSplit:       stamps and payloads are kept in two dense arrays, so a buffer is a
+         *               fraction of the size and the consumer's head scan touches fewer lines.
+         */
+        enum class node_layout {
+            kInterleaved,
+            kSplit
+        };
 
-                    std::atomic<std::uint64_t> count_ alignas(kAlignment);
+        /* The order the consumer takes elements in.
+         *
+         * kLinearizable: every element is stamped from one shared counter and they are taken in
+         *                stamp order.
+         * kRelaxed:      only each producer's own elements keep their order. Producers never
+         *                touch a shared counter, the consumer takes from the lanes, then the
+         *                unbounded list, in turn.
+         */
+        enum class ordering {
+            kLinearizable,
+            kRelaxed
+        };
 
-                    T data_;
-            };
+        /* How many elements the consumer takes from a lane in relaxed order before moving on */
+        static constexpr std::size_t kDefaultMPSCRelaxedRun = 64;
 
-        public:
+        /* Where adaptive lanes read the time from when they roll over. A test can name its own
+         * in the queue's options to step time by hand.
+         */
+        struct lane_clock {
+                std::chrono::steady_clock::time_point (*now_)() noexcept;
+        };
 
-            using value_type         = T;
-            using deconstructor_type = F;
+        inline std::chrono::steady_clock::time_point
+        steady_now() noexcept
+        {
+            return std::chrono::steady_clock::now();
+        }
 
-            spin_overflow_mpsc_queue(std::uint64_t _num_threads)
-                : heads_(_num_threads), extra_head_(new extra_node), tails_(_num_threads),
-                  up_to_(0), buffers_(_num_threads), extra_tail_(extra_head_)
-            {
-                for (std::size_t i = 0; i < _num_threads; ++i)
-                {
-                    auto* buf = new node_buffer;
-                    heads_[i] = buf;
-                    tails_[i] = buf;
-                }
-            }
+        inline constexpr lane_clock kSteadyClock{&steady_now};
 
-            ~spin_overflow_mpsc_queue()
-            {
-                deconstructor_type t;
+        /* The queue's tuning knobs, each defaulting to the plain queue. Name only the ones that
+         * change, e.g. spin_overflow_mpsc_queue<T, F, 64, 4096, {.stats_ = true}>.
+         */
+        struct options {
+                node_layout    layout_    = node_layout::kInterleaved;
+                lane_selection selection_ = lane_selection::kLinear;
+                bool           stats_     = false;
+                ordering       ordering_  = ordering::kLinearizable;
 
-                for (auto h : heads_)
-                {
-                    while (h)
-                    {
+                /* The high water mark of the pool shared by every producer, 0 for none */
+                std::size_t shared_pool_ = 0;
 
-                        for (std::size_t i = h->read_head_; i < BufferSize; ++i)
-                        {
-                            if (h->elements_[i].count_.load() != kEmpty)
-                            {
-                                t(&h->elements_[i].data_);
-                            }
-                            else
-                            {
-                                break;
-                            }
-                        }
+                /* The smallest buffer an adaptive lane uses, 0 for BufferSize (not adaptive) */
+                std::size_t min_buffer_ = 0;
 
-                        auto tmp = h->next_;
-                        delete h;
-                        h = tmp;
-                    }
-                }
+                /* What adaptive lanes read the time from */
+                const lane_clock* clock_ = &kSteadyClock;
+        };
+
+        /* What a producer has done with its lane */
+        struct producer_stats {
+                std::uint64_t enqueued_;
+                std::uint64_t allocated_; /* Buffers allocated as none had been recycled */
+                std::uint64_t recycled_;  /* Buffers reused from the allocation pool */
+        };
+
+        /* Only the lane's producer writes the counters, so they are bumped with a plain store.
+         * Any thread can take a snapshot.
+         */
+        class lane_stats {
 
-                for (auto& q : buffers_)
+            public:
+
+                void
+                enqueued(std::uint64_t _count) noexcept
                 {
-                    node_buffer* to_delete = nullptr;
-                    while ((to_delete = q.drain()))
-                    {
-                        delete to_delete;
-                    }
+                    bump(enqueued_, _count);
                 }
 
-                while (extra_head_)
+                void
+                allocated() noexcept
                 {
-                    auto tmp    = extra_head_;
-                    extra_head_ = tmp->next_.load();
-                    t(&tmp->data_);
-                    delete tmp;
+                    bump(allocated_, 1);
                 }
-            }
 
-            void
-            safe_enqueue(T _data, std::uint16_t _t_id) noexcept
-            {
-                if (_t_id < tails_.size()) { unsafe_enqueue(_data, _t_id); }
-                else
+                void
+                recycled() noexcept
                 {
+                    bump(recycled_, 1);
+                }
 
-                    overflow_enqueue(_data);
+                producer_stats
+                snapshot() const noexcept
+                {
+                    return {
+                        enqueued_.load(std::memory_order_relaxed),
+                        allocated_.load(std::memory_order_relaxed),
+                        recycled_.load(std::memory_order_relaxed)};
                 }
-            }
 
-            void
-            unsafe_enqueue(T _data, std::uint16_t _t_id) noexcept
-            {
-                auto* buffer = tails_[_t_id];
-                if (buffer->write_head_ == BufferSize - 1)
+            private:
+
+                static void
+                bump(std::atomic<std::uint64_t>& _counter, std::uint64_t _by) noexcept
                 {
-                    tails_[_t_id] = buffers_[_t_id].pop();
-                    buffer->next_ = tails_[_t_id];
-                    assert(tails_[_t_id]);
+                    _counter.store(
+                        _counter.load(std::memory_order_relaxed) + _by,
+                        std::memory_order_relaxed);
                 }
 
-                auto cur = up_to_.load(std::memory_order_acquire);
+                std::atomic<std::uint64_t> enqueued_{0};
+                std::atomic<std::uint64_t> allocated_{0};
+                std::atomic<std::uint64_t> recycled_{0};
+        };
 
-                buffer->elements_[buffer->write_head_].data_ = _data;
+        /* Stand in for lane_stats when they aren't kept */
+        struct no_stats {
 
-                buffer->elements_[buffer->write_head_++].count_.store(
-                    cur,
-                    std::memory_order_release);
+                void
+                enqueued(std::uint64_t) noexcept
+                { }
 
-                if (cur == up_to_.load(std::memory_order_acq_rel))
-                {
-                    up_to_.fetch_add(1, std::memory_order_release);
-                }
-            }
+                void
+                allocated() noexcept
+                { }
 
-            void
-            overflow_enqueue(T _data)
-            {
-                auto cur = up_to_.load(std::memory_order_acquire);
+                void
+                recycled() noexcept
+                { }
+        };
 
-                auto ptr = new extra_node(_data, cur);
-                auto old = extra_tail_.exchange(ptr, std::memory_order_acq_rel);
-                old->next_.store(ptr, std::memory_order_release);
+        /* Which of a queue's lanes are leased to a thread, a bit per lane. A lane that isn't
+         * for leasing has its bit set for good. The words come in
+         * segments of doubling size, never moved, so threads can lease while add_lanes() grows
+         * it. Kept on the global heap, the threads' leases can hold it past the queue and its
+         * resource.
+         */
+        class lane_registry {
+
+            public:
 
-                if (cur == up_to_.load(std::memory_order_acq_rel))
+                explicit lane_registry(std::size_t _lanes) : lanes_(0), segments_()
                 {
-                    up_to_.fetch_add(1, std::memory_order_release);
+                    grow(_lanes, false);
                 }
-            }
 
-            void
-            enqueue(T _data) noexcept
-            {
-                return safe_enqueue(_data, kUnknown);
-            }
+                lane_registry(const lane_registry&) = delete;
 
-            std::optional<T>
-            dequeue() noexcept
-            {
-                while (true)
+                lane_registry&
+                operator=(const lane_registry&) = delete;
+
+                ~lane_registry()
                 {
-                    std::int64_t prev_index = -2;
-                    while (true)
+                    for (std::size_t i = 0; i < kSegments; ++i)
                     {
-                        auto         min_count = kEmpty;
-                        std::int64_t min_index = -1;
-
-                        /* Check Unbounded */
-                        auto extra_next = extra_head_->next_.load(std::memory_order_acquire);
-                        if (extra_next)
-                        {
-                            min_count = extra_next->count_.load(std::memory_order_acquire);
-                            min_index = prev_index;
-                        }
+                        delete[] segments_[i].load(std::memory_order_relaxed);
+                    }
+                }
 
-                        /* Check bounded */
-                        for (std::uint64_t i = 0; i < heads_.size(); ++i)
+                /* Leases the first free lane, -1 if they are all leased */
+                std::int64_t
+                acquire() noexcept
+                {
+                    auto lanes = lanes_.load(std::memory_order_acquire);
+                    for (std::size_t i = 0; i < (lanes + 63) / 64; ++i)
+                    {
+                        auto& word = word_at(i);
+                        auto  bits = word.load(std::memory_order_relaxed);
+                        while (auto free = ~bits & valid(i, lanes))
                         {
-                            assert(heads_[i]->read_head_ < BufferSize);
-
-                            auto count = heads_[i]->elements_[heads_[i]->read_head_].count_.load(
-                                std::memory_order_acquire);
-
-                            if (count < min_count)
+                            auto bit = std::countr_zero(free);
+                            if (word.compare_exchange_weak(
+                                    bits,
+                                    bits | (std::uint64_t{1} << bit),
+                                    std::memory_order_acquire,
+                                    std::memory_order_relaxed))
                             {
-                                min_count = count;
-                                min_index = i;
+                                return i * 64 + bit;
                             }
                         }
+                    }
 
-                        if (min_index == -1 && prev_index == min_index) { return std::nullopt; }
-
-                        if (prev_index == min_index)
-                        {
-                            T data;
-
-                            if (min_index >= 0)
-                            {
-                                data = heads_[min_index]
-                                           ->elements_[heads_[min_index]->read_head_++]
-                                           .data_;
+                    return -1;
+                }
 
-                                if (heads_[min_index]->read_head_ == BufferSize)
-                                {
+                /* The lane's producer state is handed over with it */
+                void
+                release(std::size_t _lane) noexcept
+                {
+                    word_at(_lane / 64).fetch_and(
+                        ~(std::uint64_t{1} << (_lane % 64)),
+                        std::memory_order_release);
+                }
 
-                                    auto tmp          = heads_[min_index];
-                                    heads_[min_index] = tmp->next_;
+                /* Covers lanes up to _lanes from now on, the new ones kept from leasing unless
+                 * _leasable. Only called by one thread at a time, under the queue's lock.
+                 */
+                void
+                grow(std::size_t _lanes, bool _leasable)
+                {
+                    auto words = (_lanes + 63) / 64;
+                    for (std::size_t i = 0; i < kSegments && segment_first(i) < words; ++i)
+                    {
+                        if (segments_[i].load(std::memory_order_relaxed)) { continue; }
 
-                                    assert(heads_[min_index]);
+                        segments_[i].store(
+                            new std::atomic<std::uint64_t>[segment_size(i)](),
+                            std::memory_order_release);
+                    }
 
-                                    buffers_[min_index].push(tmp);
-                                }
-                            }
-                            else
-                            {
-                                auto tmp    = extra_head_;
-                                extra_head_ = extra_next;
+                    for (auto lane = lanes_.load(std::memory_order_relaxed);
+                         !_leasable && lane < _lanes;
+                         ++lane)
+                    {
+                        word_at(lane / 64).fetch_or(
+                            std::uint64_t{1} << (lane % 64),
+                            std::memory_order_relaxed);
+                    }
 
-                                data = extra_next->data_;
+                    lanes_.store(_lanes, std::memory_order_release);
+                }
 
-                                delete tmp;
-                            }
+            private:
 
-                            return data;
-                        }
+                /* Word 0 has a segment of its own, then each segment doubles */
+                static constexpr std::size_t kSegments = std::bit_width(kMaxLanes / 64 - 1) + 1;
 
-                        prev_index = min_index;
-                    }
+                static constexpr std::size_t
+                segment_first(std::size_t _segment) noexcept
+                {
+                    return _segment ? std::size_t{1} << (_segment - 1) : 0;
                 }
-            }
+
+                static constexpr std::size_t
+                segment_size(std::size_t _segment) noexcept
+                {
+                    return _segment ? std::size_t{1} << (_segment - 1) : 1;
+                }
+
+                std::atomic<std::uint64_t>&
+                word_at(std::size_t _index) noexcept
+                {
+                    std::size_t segment = std::bit_width(_index);
+
+                    return segments_[segment].load(
+                        std::memory_order_acquire)[_index - segment_first(segment)];
+                }
+
+                /* The bits of word _index that stand for one of _lanes lanes */
+                static std::uint64_t
+                valid(std::size_t _index, std::size_t _lanes) noexcept
+                {
+                    auto bits = std::min<std::size_t>(_lanes - _index * 64, 64);
+
+                    return bits == 64 ? ~std::uint64_t{0} : (std::uint64_t{1} << bits) - 1;
+                }
+
+                std::atomic<std::size_t>                 lanes_;
+                std::atomic<std::atomic<std::uint64_t>*> segments_[kSegments];
+        };
+
+        /* The lanes a thread has leased, one per queue, handed back when the thread exits. A
+         * queue destroyed first leaves its lease expired.
+         */
+        class lane_leases {
+
+            public:
+
+                lane_leases() = default;
+
+                lane_leases(const lane_leases&) = delete;
+
+                lane_leases&
+                operator=(const lane_leases&) = delete;
+
+                ~lane_leases()
+                {
+                    for (auto& lease : leases_)
+                    {
+                        auto registry = lease.registry_.lock();
+                        if (registry) { registry->release(lease.lane_); }
+                    }
+                }
+
+                /* The thread's lane in _registry, leased the first time. -1 if none are free */
+                std::int64_t
+                lane(const std::shared_ptr<lane_registry>& _registry)
+                {
+                    for (auto& lease : leases_)
+                    {
+                        if (!lease.registry_.owner_before(_registry) &&
+                            !_registry.owner_before(lease.registry_))
+                        {
+                            return lease.lane_;
+                        }
+                    }
+
+                    std::erase_if(
+                        leases_,
+                        [](const lease& _lease) { return _lease.registry_.expired(); });
+
+                    auto lane = _registry->acquire();
+                    if (lane >= 0) { leases_.push_back({_registry, lane}); }
+
+                    return lane;
+                }
+
+            private:
+
+                struct lease {
+                        std::weak_ptr<lane_registry> registry_;
+                        std::int64_t                 lane_;
+                };
+
+                std::vector<lease> leases_;
+        };
+
+        inline thread_local lane_leases thread_leases;
+
+    }   // namespace spin_overflow_details
+
+    template <
+        typename T,
+        spin_overflow_details::Deconstructor<T> F = spin_overflow_details::deconstruct_noop<T>,
+        std::size_t BufferSize                    = spin_overflow_details::kDefaultMPSCSize,
+        std::size_t AllocationSize = spin_overflow_details::kDefaultMPSCAllocationBufferSize,
+        spin_overflow_details::options Options = {}>
+    class spin_overflow_mpsc_queue {
 
         private:
 
-            std::vector<node_buffer*> heads_ alignas(kAlignment);
-            extra_node*               extra_head_ alignas(kAlignment);
+            /* The options under the names the rest of the queue uses */
+            static constexpr auto Layout     = Options.layout_;
+            static constexpr auto Selection  = Options.selection_;
+            static constexpr auto Stats      = Options.stats_;
+            static constexpr auto Ordering   = Options.ordering_;
+            static constexpr auto SharedPool = Options.shared_pool_;
+            static constexpr auto MinBuffer  =
+                Options.min_buffer_ ? Options.min_buffer_ : BufferSize;
 
-            std::vector<node_buffer*>  tails_ alignas(kAlignment);
-            std::atomic<std::uint64_t> up_to_ alignas(kAlignment);
+            static constexpr auto kEmpty = std::numeric_limits<std::size_t>::max();
+
+            /* Top bit of a stored stamp: the parity of the buffer's epoch. No stamp gets near it */
+            static constexpr std::uint64_t kEpochBit = std::uint64_t{1} << 63;
+
+            /* min_index of an element on the unbounded list */
+            static constexpr std::int64_t kOverflowIndex = -3;
+
+            static constexpr auto kAlignment =
+                spin_overflow_details::hardware_destructive_interference_size;
+
+            /* Enough segments for every lane a std::uint16_t can name */
+            static constexpr std::size_t kSegments = std::bit_width(
+                spin_overflow_details::kMaxLanes / spin_overflow_details::kDefaultMPSCLaneSegment);
+
+            /* Lanes size their buffers between MinBuffer and BufferSize elements */
+            static constexpr bool kAdaptive = MinBuffer != BufferSize;
+
+            static_assert(MinBuffer >= 2 && MinBuffer <= BufferSize, "MinBuffer is out of range");
+
+            static constexpr bool kRelaxed =
+                Ordering == spin_overflow_details::ordering::kRelaxed;
+
+            /* Producers keep active_: kActive only searches the lanes in it, kTournament only reads
+             * them again. Relaxed order goes round every lane anyway.
+             */
+            static constexpr bool kActiveLanes =
+                (Selection == spin_overflow_details::lane_selection::kActive ||
+                 Selection == spin_overflow_details::lane_selection::kTournament) &&
+                !kRelaxed;
+
+            static constexpr bool kKnownLanes =
+                kActiveLanes && Selection == spin_overflow_details::lane_selection::kTournament;
+
+            /* Visits to drained lanes still in the bitmap that pay for clearing them */
+            static constexpr std::size_t kStaleVisits = 1024;
+
+            struct alignas(kAlignment) node {
+
+                    node() : count_(kEmpty) { }
+
+                    ~node() { }
+
+                    /* Raw storage: the producer constructs the payload, the consumer destroys it */
+                    union {
+                            T data_;
+                    };
+
+                    std::atomic<std::uint64_t> count_;
+            };
+
+            /* One cache line per node: the stamp and payload travel together. The nodes follow
+             * the buffer's header, as many as the buffer holds.
+             */
+            struct interleaved_elements {
+
+                    static constexpr std::size_t
+                    bytes(std::size_t _capacity) noexcept
+                    {
+                        return _capacity * sizeof(node);
+                    }
+
+                    interleaved_elements(std::byte* _storage, std::size_t _capacity)
+                    {
+                        std::uninitialized_default_construct_n(
+                            reinterpret_cast<node*>(_storage),
+                            _capacity);
+
+                        nodes_ = std::launder(reinterpret_cast<node*>(_storage));
+                    }
+
+                    void
+                    destroy(std::size_t _capacity) noexcept
+                    {
+                        std::destroy_n(nodes_, _capacity);
+                    }
+
+                    std::atomic<std::uint64_t>&
+                    count(std::size_t _index) noexcept
+                    {
+                        return nodes_[_index].count_;
+                    }
+
+                    T&
+                    data(std::size_t _index) noexcept
+                    {
+                        return nodes_[_index].data_;
+                    }
+
+                    node* nodes_;
+            };
+
+            /* Stamps and payloads in separate dense arrays, the payloads starting on a new line.
+             * The payloads are raw storage, like the interleaved nodes'.
+             */
+            struct split_elements {
+
+                    static constexpr std::size_t
+                    data_offset(std::size_t _capacity) noexcept
+                    {
+                        auto counts = _capacity * sizeof(std::atomic<std::uint64_t>);
+
+                        return (counts + kAlignment - 1) / kAlignment * kAlignment;
+                    }
+
+                    static constexpr std::size_t
+                    bytes(std::size_t _capacity) noexcept
+                    {
+                        return data_offset(_capacity) + _capacity * sizeof(T);
+                    }
+
+                    split_elements(std::byte* _storage, std::size_t _capacity)
+                    {
+                        auto* counts = reinterpret_cast<std::atomic<std::uint64_t>*>(_storage);
+
+                        std::uninitialized_fill_n(counts, _capacity, kEmpty);
+
+                        counts_ = std::launder(counts);
+                        data_   = reinterpret_cast<T*>(_storage + data_offset(_capacity));
+                    }
+
+                    void
+                    destroy(std::size_t) noexcept
+                    { }
+
+                    std::atomic<std::uint64_t>&
+                    count(std::size_t _index) noexcept
+                    {
+                        return counts_[_index];
+                    }
+
+                    T&
+                    data(std::size_t _index) noexcept
+                    {
+                        return data_[_index];
+                    }
+
+                    std::atomic<std::uint64_t>* counts_;
+
+                    T* data_;
+            };
+
+            using elements_type = std::conditional_t<
+                Layout == spin_overflow_details::node_layout::kSplit,
+                split_elements,
+                interleaved_elements>;
+
+            using stamp_mirror = std::vector<
+                std::uint64_t,
+                spin_overflow_details::cache_aligned_allocator<std::uint64_t>>;
+
+            /* Stand in for the tournament_tree when the lanes are searched linearly */
+            struct no_tree {
+
+                    no_tree(std::size_t, std::pmr::memory_resource*) noexcept { }
+            };
+
+            using tree_type = std::conditional_t<
+                Selection == spin_overflow_details::lane_selection::kTournament,
+                spin_overflow_details::tournament_tree,
+                no_tree>;
+
+            struct alignas(kAlignment) node_buffer {
+
+                    explicit node_buffer(std::size_t _capacity)
+                        : read_head_(0), next_(nullptr), epoch_(0), capacity_(_capacity),
+                          elements_(storage(), _capacity), write_head_(0)
+                    { }
+
+                    ~node_buffer() { elements_.destroy(capacity_); }
+
+                    node_buffer(const node_buffer&) = delete;
+
+                    node_buffer&
+                    operator=(const node_buffer&) = delete;
+
+                    /* The bytes of a buffer of _capacity elements, its header then the elements */
+                    static constexpr std::size_t
+                    bytes(std::size_t _capacity) noexcept
+                    {
+                        return sizeof(node_buffer) + elements_type::bytes(_capacity);
+                    }
+
+                    /* A buffer of _capacity elements, placed on NUMA node _node unless it is -1 */
+                    static node_buffer*
+                    create(
+                        std::size_t                       _capacity,
+                        std::pmr::polymorphic_allocator<> _allocator,
+                        int                               _node)
+                    {
+                        auto  size   = bytes(_capacity);
+                        auto* memory = _allocator.allocate_bytes(size, alignof(node_buffer));
+                        spin_overflow_details::prefer_node(memory, size, _node);
+
+                        return new (memory) node_buffer(_capacity);
+                    }
+
+                    static void
+                    destroy(node_buffer* _buffer, std::pmr::polymorphic_allocator<> _allocator)
+                    {
+                        auto size = bytes(_buffer->capacity_);
+                        std::destroy_at(_buffer);
+                        _allocator.deallocate_bytes(_buffer, size, alignof(node_buffer));
+                    }
+
+                    /* Ready for another pass of the lane. The stamps left over from the last pass
+                     * don't carry the new epoch, so they read as unwritten without being reset.
+                     * The payloads were destroyed as they were taken.
+                     */
+                    void
+                    recycle() noexcept
+                    {
+                        read_head_  = 0;
+                        next_       = nullptr;
+                        write_head_ = 0;
+                        epoch_ ^= kEpochBit;
+                    }
+
+                    /* The stamp at _index, or kEmpty if it hasn't been written this epoch */
+                    std::uint64_t
+                    load_stamp(std::size_t _index) noexcept
+                    {
+                        auto count = elements_.count(_index).load(std::memory_order_acquire);
+
+                        return (count & kEpochBit) == epoch_ ? count & ~kEpochBit : kEmpty;
+                    }
+
+                    void
+                    store_stamp(
+                        std::size_t       _index,
+                        std::uint64_t     _stamp,
+                        std::memory_order _order) noexcept
+                    {
+                        elements_.count(_index).store(_stamp | epoch_, _order);
+                    }
+
+                    std::byte*
+                    storage() noexcept
+                    {
+                        return reinterpret_cast<std::byte*>(this) + sizeof(node_buffer);
+                    }
+
+                    std::size_t read_head_ alignas(kAlignment);
+
+                    node_buffer* next_ alignas(kAlignment);
+
+                    /* Only changes while the buffer is in the pool */
+                    std::uint64_t epoch_;
+
+                    std::size_t capacity_;
+
+                    elements_type elements_;
+
+                    std::size_t write_head_ alignas(kAlignment);
+            };
+
+            struct alignas(kAlignment) allocation_pool {
+
+                    /* Running counts, the slot is the count modulo AllocationSize */
+                    std::atomic<std::uint64_t> read_count_ alignas(kAlignment);
+
+                    std::atomic<std::uint64_t> write_count_ alignas(kAlignment);
+
+                    struct alignas(kAlignment) aligned_ptr {
+                            std::atomic<node_buffer*> ptr_;
+                    };
+
+                    aligned_ptr items_[AllocationSize];
+
+                    /* Consumer only. False if the ring is full, the buffer is left as it was */
+                    bool
+                    push(node_buffer* _ptr) noexcept
+                    {
+                        auto write_idx = write_count_.load(std::memory_order_relaxed);
+
+                        /* Full, it holds up to AllocationSize - 1 buffers */
+                        if (write_idx - read_count_.load(std::memory_order_acquire) ==
+                            AllocationSize - 1)
+                        {
+                            return false;
+                        }
+
+                        _ptr->recycle();
+
+                        items_[write_idx % AllocationSize].ptr_.store(
+                            _ptr,
+                            std::memory_order_relaxed);
+
+                        write_count_.store(write_idx + 1, std::memory_order_release);
+
+                        return true;
+                    }
+
+                    /* nullptr if the consumer hasn't handed a buffer back. Mostly the producer's,
+                     * but the consumer takes buffers back from it to trim, so a slot is claimed by
+                     * moving the read count on. The counts never wrap, so a claim can't succeed on
+                     * a slot that has been refilled since it was read.
+                     */
+                    node_buffer*
+                    pop() noexcept
+                    {
+                        auto read_idx = read_count_.load(std::memory_order_relaxed);
+                        while (true)
+                        {
+                            if (read_idx == write_count_.load(std::memory_order_acquire))
+                            {
+                                return nullptr;
+                            }
+
+                            auto* tmp = items_[read_idx % AllocationSize].ptr_.load(
+                                std::memory_order_relaxed);
+
+                            if (read_count_.compare_exchange_weak(
+                                    read_idx,
+                                    read_idx + 1,
+                                    std::memory_order_acq_rel,
+                                    std::memory_order_relaxed))
+                            {
+                                return tmp;
+                            }
+                        }
+                    }
+
+                    /* Consumer only, the buffers it could take back */
+                    std::size_t
+                    size() const noexcept
+                    {
+                        return write_count_.load(std::memory_order_relaxed) -
+                               read_count_.load(std::memory_order_acquire);
+                    }
+
+                    node_buffer*
+                    drain()
+                    {
+                        auto read_idx = read_count_.load(std::memory_order_relaxed);
+                        if (read_idx == write_count_.load(std::memory_order_relaxed))
+                        {
+                            return nullptr;
+                        }
+
+                        read_count_.store(read_idx + 1, std::memory_order_relaxed);
+
+                        return items_[read_idx % AllocationSize].ptr_.load(
+                            std::memory_order_relaxed);
+                    }
+            };
+
+            /* Buffers the lanes' own pools had no room for, for whichever producer needs one next
+             * instead of being deleted. A bounded MPMC ring of SharedPool buffers, rounded up to a
+             * power of two, that only the consumer pushes to. Each cell's sequence says which lap
+             * it is ready for, so producers claiming cells can't be fooled by a recycled pointer.
+             */
+            struct shared_pool {
+
+                    static constexpr std::size_t kSize = std::bit_ceil(SharedPool);
+
+                    struct alignas(kAlignment) cell {
+                            std::atomic<std::size_t> sequence_;
+                            node_buffer*             ptr_;
+                    };
+
+                    shared_pool() : push_index_(0), pop_index_(0)
+                    {
+                        for (std::size_t i = 0; i < kSize; ++i)
+                        {
+                            cells_[i].sequence_.store(i, std::memory_order_relaxed);
+                        }
+                    }
+
+                    /* Consumer only. False if the pool is at its high water mark */
+                    bool
+                    push(node_buffer* _ptr) noexcept
+                    {
+                        auto& cell = cells_[push_index_ & (kSize - 1)];
+                        if (cell.sequence_.load(std::memory_order_acquire) != push_index_)
+                        {
+                            return false;
+                        }
+
+                        _ptr->recycle();
+                        cell.ptr_ = _ptr;
+                        cell.sequence_.store(push_index_ + 1, std::memory_order_release);
+                        ++push_index_;
+
+                        return true;
+                    }
+
+                    node_buffer*
+                    pop() noexcept
+                    {
+                        auto index = pop_index_.load(std::memory_order_relaxed);
+                        while (true)
+                        {
+                            auto& cell = cells_[index & (kSize - 1)];
+                            auto  lap  = static_cast<std::int64_t>(
+                                cell.sequence_.load(std::memory_order_acquire) - (index + 1));
+
+                            if (lap < 0) { return nullptr; }
+
+                            if (lap > 0) { index = pop_index_.load(std::memory_order_relaxed); }
+                            else if (pop_index_.compare_exchange_weak(
+                                         index,
+                                         index + 1,
+                                         std::memory_order_relaxed))
+                            {
+                                auto* ptr = cell.ptr_;
+                                cell.sequence_.store(index + kSize, std::memory_order_release);
+
+                                return ptr;
+                            }
+                        }
+                    }
+
+                    /* Consumer only, roughly how many buffers are waiting */
+                    std::size_t
+                    size() const noexcept
+                    {
+                        return push_index_ - pop_index_.load(std::memory_order_relaxed);
+                    }
+
+                    std::size_t push_index_ alignas(kAlignment);
+
+                    std::atomic<std::size_t> pop_index_ alignas(kAlignment);
+
+                    cell cells_[kSize];
+            };
+
+            /* Stand in for the shared_pool when SharedPool is 0 */
+            struct no_shared_pool {
+
+                    bool
+                    push(node_buffer*) noexcept
+                    {
+                        return false;
+                    }
+
+                    node_buffer*
+                    pop() noexcept
+                    {
+                        return nullptr;
+                    }
 
-            std::vector<allocation_pool> buffers_ alignas(kAlignment);
+                    std::size_t
+                    size() const noexcept
+                    {
+                        return 0;
+                    }
+            };
+
+            using shared_pool_type =
+                std::conditional_t<SharedPool == 0, no_shared_pool, shared_pool>;
+
+            using stats_type = std::conditional_t<
+                Stats,
+                spin_overflow_details::lane_stats,
+                spin_overflow_details::no_stats>;
+
+            /* Everything a producer writes. The tail and stats share a line of their own and the
+             * pool's indices are each on their own line, so producers never write to the same
+             * line as each other or to the consumer's.
+             */
+            struct alignas(kAlignment) producer_block {
+
+                    producer_block()
+                        : tail_(nullptr), idle_(true), first_(nullptr), node_(-1), spare_(nullptr),
+                          capacity_(MinBuffer), rolled_()
+                    { }
+
+                    /* Allocates the lane's first buffer on the producer's thread, so its pages are
+                     * first touched on the producer's node, and publishes it to the consumer.
+                     */
+                    void
+                    start(shared_pool_type& _shared, std::pmr::polymorphic_allocator<> _allocator)
+                    {
+                        tail_ = next_buffer(_shared, _allocator);
+                        first_.store(tail_, std::memory_order_release);
+                    }
+
+                    /* The next buffer of the lane, recycled if the consumer has handed one back
+                     * to the lane or the shared pool
+                     */
+                    node_buffer*
+                    next_buffer(
+                        shared_pool_type&                 _shared,
+                        std::pmr::polymorphic_allocator<> _allocator)
+                    {
+                        if constexpr (kAdaptive) { resize(); }
+
+                        if (auto* buffer = spare_)
+                        {
+                            spare_        = buffer->next_;
+                            buffer->next_ = nullptr;
+                            return buffer;
+                        }
+
+                        if (auto* buffer = pool_.pop()) { return reuse(buffer, _allocator); }
+
+                        if (auto* buffer = _shared.pop()) { return reuse(buffer, _allocator); }
+
+                        return allocate(_allocator);
+                    }
+
+                    /* A new buffer of the lane's current size, placed on its node if it has one */
+                    node_buffer*
+                    allocate(std::pmr::polymorphic_allocator<> _allocator)
+                    {
+                        stats_.allocated();
+
+                        return node_buffer::create(capacity_, _allocator, node_);
+                    }
+
+                    /* A recycled buffer, swapped for a new one if the lane has since resized */
+                    node_buffer*
+                    reuse(node_buffer* _buffer, std::pmr::polymorphic_allocator<> _allocator)
+                    {
+                        if (kAdaptive && _buffer->capacity_ != capacity_)
+                        {
+                            node_buffer::destroy(_buffer, _allocator);
+                            return allocate(_allocator);
+                        }
+
+                        stats_.recycled();
+                        return _buffer;
+                    }
+
+                    /* Sizes the lane's next buffer by how long the last one took to fill */
+                    void
+                    resize() noexcept
+                    {
+                        auto now     = Options.clock_->now_();
+                        auto elapsed = now - rolled_;
+                        rolled_      = now;
+
+                        if (elapsed < spin_overflow_details::kDefaultMPSCGrowInterval)
+                        {
+                            capacity_ = std::min(capacity_ * 2, BufferSize);
+                        }
+                        else if (elapsed > spin_overflow_details::kDefaultMPSCShrinkInterval)
+                        {
+                            capacity_ = std::max(capacity_ / 2, MinBuffer);
+                        }
+                    }
+
+                    node_buffer*                     tail_;
+                    [[no_unique_address]] stats_type stats_;
+
+                    /* The lane's bit is clear in active_, kActiveLanes only */
+                    std::atomic<bool> idle_;
+
+                    /* The lane's first buffer, nullptr until the producer starts the lane */
+                    std::atomic<node_buffer*> first_;
+
+                    /* The NUMA node to place the lane's buffers on, -1 for wherever */
+                    int node_;
+
+                    /* Buffers reserved for the lane's next rollovers, linked through next_ */
+                    node_buffer* spare_;
+
+                    /* The size of the lane's next buffer and when it last rolled over */
+                    std::size_t                           capacity_;
+                    std::chrono::steady_clock::time_point rolled_;
+
+                    allocation_pool pool_;
+            };
+
+            using producer_list = std::vector<
+                producer_block,
+                spin_overflow_details::cache_aligned_allocator<producer_block>>;
+
+            using buffer_list = std::vector<
+                node_buffer*,
+                spin_overflow_details::cache_aligned_allocator<node_buffer*>>;
+
+            /* The bitmap of written lanes, whole lines from the queue's resource */
+            using active_list = std::vector<
+                std::atomic<std::uint64_t>,
+                spin_overflow_details::cache_aligned_allocator<std::atomic<std::uint64_t>>>;
+
+            struct alignas(kAlignment) extra_node {
+
+                    extra_node() : next_(nullptr), count_(kEmpty) { }
+
+                    template <typename... Args>
+                    extra_node(std::uint64_t _count, Args&&... _args)
+                        : next_(nullptr), count_(_count), data_(std::forward<Args>(_args)...)
+                    { }
+
+                    ~extra_node() { }
+
+                    std::atomic<extra_node*> next_ alignas(kAlignment);
+
+                    std::atomic<std::uint64_t> count_ alignas(kAlignment);
+
+                    /* Raw storage, empty in the list's stub */
+                    union {
+                            T data_;
+                    };
+            };
+
+        public:
+
+            using value_type         = T;
+            using deconstructor_type = F;
+
+            /* An element prepare() has put at the tail of a lane, for the producer to fill in
+             * place. The consumer can't see it until it is passed to commit().
+             */
+            struct slot {
+
+                    T&
+                    operator*() const noexcept
+                    {
+                        return *data_;
+                    }
+
+                    T*
+                    operator->() const noexcept
+                    {
+                        return data_;
+                    }
+
+                    T*            data_;
+                    node_buffer*  buffer_;
+                    std::uint16_t t_id_;
+            };
+
+            /* The size of one of the queue's buffers, for sizing a memory resource */
+            static constexpr std::size_t
+            buffer_bytes() noexcept
+            {
+                return node_buffer::bytes(BufferSize);
+            }
+
+            spin_overflow_mpsc_queue(
+                std::uint64_t              _num_threads,
+                std::pmr::memory_resource* _resource = std::pmr::new_delete_resource())
+                : allocator_(_resource),
+                  leasing_(false),
+                  heads_(_num_threads, _resource),
+                  stamps_(mirror_size(_num_threads), kEmpty, _resource),
+                  tree_(_num_threads, _resource), run_index_(0), run_length_(0),
+                  retired_(_num_threads, nullptr, _resource), has_retired_(false),
+                  known_(kKnownLanes ? spin_overflow_details::kMaxLanes / 64 : 0, 0, _resource),
+                  drained_(kActiveLanes ? spin_overflow_details::kMaxLanes / 64 : 0, 0, _resource),
+                  stale_(0),
+                  deactivating_(kActiveLanes && spin_overflow_details::process_fence_ready()),
+                  peeked_(false), peek_index_(0), extra_head_(allocator_.new_object<extra_node>()),
+                  producers_(_num_threads, _resource), segments_(), lanes_(_num_threads),
+                  active_(kActiveLanes ? spin_overflow_details::kMaxLanes / 64 : 0, _resource),
+                  up_to_(0),
+                  extra_tail_(extra_head_)
+            { }
+
+            ~spin_overflow_mpsc_queue()
+            {
+                deconstructor_type t;
+
+                sync_lanes();
+                recycle_retired();
+
+                /* Lanes started since the consumer last looked at them */
+                for (std::size_t i = 0; i < heads_.size(); ++i)
+                {
+                    lane_head(i);
+                }
+
+                for (auto h : heads_)
+                {
+                    while (h)
+                    {
+
+                        for (std::size_t i = h->read_head_; i < h->capacity_; ++i)
+                        {
+                            if (h->load_stamp(i) != kEmpty)
+                            {
+                                t(&h->elements_.data(i));
+                                std::destroy_at(&h->elements_.data(i));
+                            }
+                            else
+                            {
+                                break;
+                            }
+                        }
+
+                        auto tmp = h->next_;
+                        node_buffer::destroy(h, allocator_);
+                        h = tmp;
+                    }
+                }
+
+                for (std::size_t i = 0; i < heads_.size(); ++i)
+                {
+                    auto&        p         = producer_at(i);
+                    node_buffer* to_delete = nullptr;
+                    while ((to_delete = p.pool_.drain()))
+                    {
+                        node_buffer::destroy(to_delete, allocator_);
+                    }
+
+                    while ((to_delete = p.spare_))
+                    {
+                        p.spare_ = to_delete->next_;
+                        node_buffer::destroy(to_delete, allocator_);
+                    }
+                }
+
+                while (auto* buffer = shared_.pop())
+                {
+                    node_buffer::destroy(buffer, allocator_);
+                }
+
+                for (std::size_t i = 0; i < kSegments; ++i)
+                {
+                    if (auto* segment = segments_[i].load(std::memory_order_relaxed))
+                    {
+                        std::destroy_n(segment, segment_size(i));
+                        allocator_.deallocate_object(segment, segment_size(i));
+                    }
+                }
+
+                /* The stub's payload has been taken, or was never there */
+                auto* stub  = extra_head_;
+                extra_head_ = stub->next_.load();
+                allocator_.delete_object(stub);
+
+                while (extra_head_)
+                {
+                    auto tmp    = extra_head_;
+                    extra_head_ = tmp->next_.load();
+                    t(&tmp->data_);
+                    std::destroy_at(&tmp->data_);
+                    allocator_.delete_object(tmp);
+                }
+            }
+
+            /* Adds _count lanes while the queue is in use and returns the id of the first. The
+             * consumer picks them up on its next dequeue. Safe to call from any thread.
+             */
+            std::uint16_t
+            add_lanes(std::size_t _count)
+            {
+                std::lock_guard lock(grow_);
+
+                return grow_lanes(_count, false);
+            }
+
+            /* Adds _count lanes that only lease() hands out and returns the id of the first.
+             * Until it is called lease() has no lane to hand out. A lane that can be passed as
+             * a _t_id is never leased, so the two can be mixed. Safe to call from any thread.
+             */
+            std::uint16_t
+            lease_lanes(std::size_t _count)
+            {
+                std::lock_guard lock(grow_);
+
+                if (!registry_)
+                {
+                    registry_ = std::make_shared<spin_overflow_details::lane_registry>(
+                        lanes_.load(std::memory_order_relaxed));
+                }
+
+                auto first = grow_lanes(_count, true);
+                leasing_.store(true, std::memory_order_release);
+
+                return first;
+            }
+
+            /* How many lanes the queue has, including those added since it was built */
+            std::size_t
+            lanes() const noexcept
+            {
+                return lanes_.load(std::memory_order_acquire);
+            }
+
+            /* The lane leased to the calling thread, leasing a free one of those added by
+             * lease_lanes() the first time it asks. std::nullopt if every one is leased. The
+             * lane is handed back when the thread exits, for the next thread to lease.
+             */
+            std::optional<std::uint16_t>
+            lease()
+            {
+                if (!leasing_.load(std::memory_order_acquire)) { return std::nullopt; }
+
+                auto lane = spin_overflow_details::thread_leases.lane(registry_);
+                if (lane < 0) { return std::nullopt; }
+
+                return static_cast<std::uint16_t>(lane);
+            }
+
+            void
+            safe_enqueue(T _data, std::uint16_t _t_id) noexcept
+            {
+                safe_emplace(_t_id, std::move(_data));
+            }
+
+            /* Constructs an element from _args in place, in lane _t_id or the unbounded list */
+            template <typename... Args>
+            void
+            safe_emplace(std::uint16_t _t_id, Args&&... _args) noexcept
+            {
+                if (_t_id < lanes_.load(std::memory_order_acquire))
+                {
+                    unsafe_emplace(_t_id, std::forward<Args>(_args)...);
+                }
+                else
+                {
+
+                    overflow_emplace(std::forward<Args>(_args)...);
+                }
+            }
+
+            void
+            unsafe_enqueue(T _data, std::uint16_t _t_id) noexcept
+            {
+                unsafe_emplace(_t_id, std::move(_data));
+            }
+
+            /* Constructs an element from _args in place at the tail of lane _t_id */
+            template <typename... Args>
+            void
+            unsafe_emplace(std::uint16_t _t_id, Args&&... _args) noexcept
+            {
+                auto next = next_slot(_t_id);
+                std::construct_at(next.data_, std::forward<Args>(_args)...);
+
+                commit(next);
+            }
+
+            /* Constructs an element from _args at the tail of lane _t_id, which has to be one of
+             * the queue's lanes, for the producer to fill in place. With no _args it is default
+             * initialised. The producer can't enqueue on the lane again until it has committed.
+             */
+            template <typename... Args>
+            slot
+            prepare(std::uint16_t _t_id, Args&&... _args) noexcept
+            {
+                auto next = next_slot(_t_id);
+                if constexpr (sizeof...(Args) == 0)
+                {
+                    ::new (static_cast<void*>(next.data_)) T;
+                }
+                else
+                {
+                    std::construct_at(next.data_, std::forward<Args>(_args)...);
+                }
+
+                return next;
+            }
+
+            /* Stamps a prepared element, handing it to the consumer */
+            void
+            commit(slot _slot) noexcept
+            {
+                auto& producer = producer_at(_slot.t_id_);
+                auto* buffer   = _slot.buffer_;
+
+                auto cur = reserve_stamps();
+
+                buffer->store_stamp(buffer->write_head_++, cur, std::memory_order_release);
+
+                activate(producer, _slot.t_id_);
+
+                producer.stats_.enqueued(1);
+
+                advance(cur);
+            }
+
+            void
+            overflow_enqueue(T _data)
+            {
+                overflow_emplace(std::move(_data));
+            }
+
+            template <typename... Args>
+            void
+            overflow_emplace(Args&&... _args)
+            {
+                auto cur = reserve_stamps();
+
+                auto ptr = allocator_.new_object<extra_node>(cur, std::forward<Args>(_args)...);
+                auto old = extra_tail_.exchange(ptr, std::memory_order_acq_rel);
+                old->next_.store(ptr, std::memory_order_release);
+
+                advance(cur);
+            }
+
+            /* Enqueues on the calling thread's leased lane, or the unbounded list if it has none
+             * to lease. A failed lease never becomes a lane id, every id up to kMaxLanes can be
+             * a real lane.
+             */
+            void
+            enqueue(T _data)
+            {
+                if (auto t_id = lease()) { return unsafe_enqueue(std::move(_data), *t_id); }
+
+                overflow_emplace(std::move(_data));
+            }
+
+            void
+            safe_enqueue_bulk(std::span<const T> _data, std::uint16_t _t_id) noexcept
+            {
+                if (_t_id < lanes_.load(std::memory_order_acquire))
+                {
+                    unsafe_enqueue_bulk(_data, _t_id);
+                }
+                else
+                {
+
+                    overflow_enqueue_bulk(_data);
+                }
+            }
+
+            /* Enqueues every element of _data, the whole batch shares one stamp */
+            void
+            unsafe_enqueue_bulk(std::span<const T> _data, std::uint16_t _t_id) noexcept
+            {
+                if (_data.empty()) { return; }
+
+                auto cur = reserve_stamps();
+
+                fill(_data, _t_id, cur);
+
+                advance(cur);
+            }
+
+            void
+            overflow_enqueue_bulk(std::span<const T> _data)
+            {
+                if (_data.empty()) { return; }
+
+                auto cur = reserve_stamps();
+
+                /* Link the batch up first so it is swapped onto the list in one exchange */
+                auto* first = allocator_.new_object<extra_node>(cur, _data[0]);
+                auto* last  = first;
+                for (std::size_t i = 1; i < _data.size(); ++i)
+                {
+                    auto ptr = allocator_.new_object<extra_node>(cur, _data[i]);
+                    last->next_.store(ptr, std::memory_order_relaxed);
+                    last = ptr;
+                }
+
+                auto old = extra_tail_.exchange(last, std::memory_order_acq_rel);
+                old->next_.store(first, std::memory_order_release);
+
+                advance(cur);
+            }
+
+            /* Enqueues on the calling thread's leased lane, or the unbounded list if it has none
+             * to lease
+             */
+            void
+            enqueue_bulk(std::span<const T> _data)
+            {
+                if (auto t_id = lease()) { return unsafe_enqueue_bulk(_data, *t_id); }
+
+                overflow_enqueue_bulk(_data);
+            }
+
+            /* Takes the element peek() left at the front first, if there is one */
+            std::optional<T>
+            dequeue() noexcept
+            {
+                if (peeked_) { return take_peeked(); }
+
+                auto index = next();
+
+                if (index >= 0) { return take(index); }
+
+                if (index == kOverflowIndex) { return take_overflow(); }
+                return std::nullopt;
+            }
+
+            /* The element dequeue() would return next, left where it is, or nullptr if the queue
+             * is empty. It stays at the front until pop() or the next dequeue takes it.
+             */
+            T*
+            peek() noexcept
+            {
+                if (!peeked_)
+                {
+                    auto index = next();
+                    if (index < 0 && index != kOverflowIndex) { return nullptr; }
+
+                    peeked_     = true;
+                    peek_index_ = index;
+                }
+
+                return &front();
+            }
+
+            /* Destroys the element peek() returned and moves on, nothing if there isn't one. Its
+             * buffer is handed back once the consumer is done with it.
+             */
+            void
+            pop() noexcept
+            {
+                if (!peeked_) { return; }
+
+                peeked_ = false;
+
+                if (peek_index_ == kOverflowIndex) { return release_overflow(); }
+
+                release(peek_index_);
+            }
+
+            /* Writes up to _max elements to _out, in the order dequeue() would return them, and
+             * returns how many were written.
+             */
+            template <typename OutputIt>
+            std::size_t
+            dequeue_bulk(OutputIt _out, std::size_t _max) noexcept(
+                noexcept(*_out++ = std::declval<T>()))
+            {
+                auto to_output = [&_out](T&& _data) { *_out++ = std::move(_data); };
+
+                return consume(_max, to_output);
+            }
+
+            /* Calls _callback with every element that is available, in the order dequeue() would
+             * return them, and returns how many there were.
+             */
+            template <typename Callback>
+            std::size_t
+            consume_all(Callback&& _callback) noexcept(noexcept(_callback(std::declval<T>())))
+            {
+                return consume(std::numeric_limits<std::size_t>::max(), _callback);
+            }
+
+            /* Allocates _buffers buffers for lane _t_id up front, so its first enqueues don't have
+             * to. The first starts the lane if it hasn't been, the rest are kept for its next
+             * rollovers. Call it from the lane's producer or before the producer starts.
+             */
+            void
+            reserve(std::uint16_t _t_id, std::size_t _buffers)
+            {
+                auto& producer = producer_at(_t_id);
+                if (_buffers && !producer.tail_)
+                {
+                    producer.start(shared_, allocator_);
+                    --_buffers;
+                }
+
+                for (; _buffers; --_buffers)
+                {
+                    auto* buffer    = producer.allocate(allocator_);
+                    buffer->next_   = producer.spare_;
+                    producer.spare_ = buffer;
+                }
+            }
+
+            /* Consumer only. Frees the buffers waiting to be reused beyond _buffers in each lane's
+             * pool and beyond _buffers in the shared pool, returning how many it freed. Buffers a
+             * producer has reserved but not yet used are left alone.
+             */
+            std::size_t
+            trim(std::size_t _buffers = 0) noexcept
+            {
+                sync_lanes();
+                recycle_retired();
+
+                std::size_t freed = 0;
+                for (std::size_t i = 0; i < heads_.size(); ++i)
+                {
+                    auto& pool = producer_at(i).pool_;
+                    while (pool.size() > _buffers)
+                    {
+                        auto* buffer = pool.pop();
+                        if (!buffer) { break; }
+
+                        node_buffer::destroy(buffer, allocator_);
+                        ++freed;
+                    }
+                }
+
+                while (shared_.size() > _buffers)
+                {
+                    auto* buffer = shared_.pop();
+                    if (!buffer) { break; }
+
+                    node_buffer::destroy(buffer, allocator_);
+                    ++freed;
+                }
+
+                return freed;
+            }
+
+            /* Places the buffers lane _t_id allocates from now on on NUMA node _node, best effort.
+             * Call it from the lane's producer or before the producer starts. Without it a lane's
+             * first buffer lands on the node of its producer, which allocates it on first use.
+             */
+            void
+            bind(std::uint16_t _t_id, int _node) noexcept
+            {
+                producer_at(_t_id).node_ = _node;
+            }
+
+            /* A snapshot of what a producer has done with its lane, only kept if Stats is set */
+            spin_overflow_details::producer_stats
+            stats(std::uint16_t _t_id) const noexcept requires Stats
+            {
+                return producer_at(_t_id).stats_.snapshot();
+            }
+
+        private:
+
+            /* The stamp for a producer to write. There is nothing to order by in relaxed order,
+             * any stamp but kEmpty marks an element as written.
+             */
+            std::uint64_t
+            reserve_stamps() noexcept
+            {
+                if constexpr (kRelaxed) { return 0; }
+                else
+                {
+                    return up_to_.load(std::memory_order_acquire);
+                }
+            }
+
+            /* Moves the shared stamp on, unless another producer already has since _stamp */
+            void
+            advance(std::uint64_t _stamp) noexcept
+            {
+                if constexpr (!kRelaxed)
+                {
+                    if (_stamp == up_to_.load(std::memory_order_acquire))
+                    {
+                        up_to_.fetch_add(1, std::memory_order_release);
+                    }
+                }
+            }
+
+            /* Sets the bit of lane _t_id if the consumer has found it drained. The compiler
+             * barrier pairs with the process wide fence in deactivate_drained(), so either the
+             * producer sees the lane idle or the consumer sees the element the producer has just
+             * written. Only the way back into the bitmap costs an atomic write.
+             */
+            void
+            activate(producer_block& _producer, std::uint16_t _t_id) noexcept
+            {
+                if constexpr (kActiveLanes)
+                {
+                    std::atomic_signal_fence(std::memory_order_seq_cst);
+                    if (_producer.idle_.load(std::memory_order_relaxed))
+                    {
+                        _producer.idle_.store(false, std::memory_order_relaxed);
+                        active_[_t_id / 64].fetch_or(
+                            std::uint64_t{1} << (_t_id % 64),
+                            std::memory_order_release);
+                    }
+                }
+            }
+
+            /* The raw storage at the tail of lane _t_id, rolling the lane over to a new buffer if
+             * it is the last of its buffer
+             */
+            slot
+            next_slot(std::uint16_t _t_id) noexcept
+            {
+                auto& producer = producer_at(_t_id);
+                if (!producer.tail_) { producer.start(shared_, allocator_); }
+
+                auto* buffer = producer.tail_;
+                if (buffer->write_head_ == buffer->capacity_ - 1)
+                {
+                    producer.tail_ = producer.next_buffer(shared_, allocator_);
+                    buffer->next_  = producer.tail_;
+                }
+
+                return {&buffer->elements_.data(buffer->write_head_), buffer, _t_id};
+            }
+
+            /* Copies _data into a lane, all stamped _stamp. The payloads of each buffer's chunk
+             * are published by a single release fence, so the stamps can be stored relaxed.
+             */
+            void
+            fill(std::span<const T> _data, std::uint16_t _t_id, std::uint64_t _stamp) noexcept
+            {
+                auto&       producer = producer_at(_t_id);
+                std::size_t done     = 0;
+
+                if (!producer.tail_) { producer.start(shared_, allocator_); }
+
+                while (done != _data.size())
+                {
+                    auto* buffer = producer.tail_;
+                    auto  start  = buffer->write_head_;
+                    auto  chunk  = std::min(_data.size() - done, buffer->capacity_ - start);
+
+                    for (std::size_t i = 0; i < chunk; ++i)
+                    {
+                        std::construct_at(&buffer->elements_.data(start + i), _data[done + i]);
+                    }
+
+                    /* The consumer moves on as soon as it takes the last element of a buffer */
+                    if (start + chunk == buffer->capacity_)
+                    {
+                        producer.tail_ = producer.next_buffer(shared_, allocator_);
+                        buffer->next_  = producer.tail_;
+                    }
+
+                    std::atomic_thread_fence(std::memory_order_release);
+
+                    for (std::size_t i = 0; i < chunk; ++i)
+                    {
+                        buffer->store_stamp(start + i, _stamp, std::memory_order_relaxed);
+                    }
+
+                    buffer->write_head_ = start + chunk;
+                    done += chunk;
+                }
+
+                activate(producer, _t_id);
+
+                producer.stats_.enqueued(_data.size());
+            }
+
+            /* The lane to take from next, kOverflowIndex for the unbounded list and -1 if there is
+             * nothing to take.
+             */
+            std::int64_t
+            next() noexcept
+            {
+                sync_lanes();
+
+                if constexpr (kRelaxed) { return next_lane(); }
+                else
+                {
+                    return confirm().second;
+                }
+            }
+
+            /* Two scans that agree on the lane holding the smallest stamp. {kEmpty, -1} if both
+             * scans found nothing.
+             */
+            std::pair<std::uint64_t, std::int64_t>
+            confirm() noexcept
+            {
+                std::int64_t prev_index = -2;
+                while (true)
+                {
+                    /* Check bounded */
+                    auto [min_count, min_index] = select();
+
+                    /* Check Unbounded */
+                    auto extra_next = extra_head_->next_.load(std::memory_order_acquire);
+                    if (extra_next)
+                    {
+                        auto count = extra_next->count_.load(std::memory_order_acquire);
+                        if (count < min_count)
+                        {
+                            min_count = count;
+                            min_index = kOverflowIndex;
+                        }
+                    }
+                    if (min_index == -1 && prev_index == min_index) { return {kEmpty, -1}; }
+
+                    if (prev_index == min_index) { return {min_count, min_index}; }
+
+                    prev_index = min_index;
+                }
+            }
+
+            template <typename Callback>
+            std::size_t
+            consume(std::size_t _max, Callback& _callback)
+            {
+                std::size_t taken = 0;
+                if (peeked_ && _max)
+                {
+                    _callback(take_peeked<true>());
+                    ++taken;
+                }
+
+                while (taken != _max)
+                {
+                    auto index = next();
+
+                    if (index >= 0) { _callback(take<true>(index)); }
+                    else if (index == kOverflowIndex) { _callback(take_overflow()); }
+                    else
+                    {
+                        break;
+                    }
+
+                    ++taken;
+                }
+
+                recycle_retired();
+
+                return taken;
+            }
+
+            /* The element peek() found */
+            T&
+            front() noexcept
+            {
+                if (peek_index_ == kOverflowIndex)
+                {
+                    return extra_head_->next_.load(std::memory_order_acquire)->data_;
+                }
+
+                auto* head = heads_[peek_index_];
+
+                return head->elements_.data(head->read_head_);
+            }
+
+            /* Takes the element peek() found, for a dequeue that comes before pop() */
+            template <bool Batched = false>
+            T
+            take_peeked() noexcept
+            {
+                peeked_ = false;
+
+                if (peek_index_ == kOverflowIndex) { return take_overflow(); }
+
+                return take<Batched>(peek_index_);
+            }
+
+            /* Takes the element at the head of a lane */
+            template <bool Batched = false>
+            T
+            take(std::size_t _index) noexcept
+            {
+                auto* head = heads_[_index];
+                T     data = std::move(head->elements_.data(head->read_head_));
+
+                release<Batched>(_index);
+
+                return data;
+            }
+
+            /* Destroys the element at the head of a lane and moves the lane on. A batch
+             * leaves the buffers it empties linked to the lane's head, to be recycled when it
+             * finishes.
+             */
+            template <bool Batched = false>
+            void
+            release(std::size_t _index) noexcept
+            {
+                auto* head = heads_[_index];
+                std::destroy_at(&head->elements_.data(head->read_head_++));
+
+                if (head->read_head_ == head->capacity_)
+                {
+                    heads_[_index] = head->next_;
+
+                    assert(heads_[_index]);
+
+                    if constexpr (Batched)
+                    {
+                        if (!retired_[_index]) { retired_[_index] = head; }
+                        has_retired_ = true;
+                    }
+                    else
+                    {
+                        hand_back(_index, head);
+                    }
+                }
+
+                if constexpr (kRelaxed)
+                {
+                    run_index_ = _index;
+                    ++run_length_;
+                }
+                else
+                {
+                    refresh(_index);
+                }
+            }
+
+            /* Takes the next element of the unbounded list */
+            T
+            take_overflow() noexcept
+            {
+                T data = std::move(extra_head_->next_.load(std::memory_order_acquire)->data_);
+
+                release_overflow();
+
+                return data;
+            }
+
+            /* Destroys the next element of the unbounded list, whose node becomes the stub */
+            void
+            release_overflow() noexcept
+            {
+                auto tmp    = extra_head_;
+                extra_head_ = tmp->next_.load(std::memory_order_acquire);
+
+                std::destroy_at(&extra_head_->data_);
+
+                allocator_.delete_object(tmp);
+
+                if constexpr (kRelaxed) { ++run_length_; }
+            }
+            /* Relaxed order: the lane to take from next, kOverflowIndex for the unbounded list or
+             * -1 if they are all empty. The consumer stays on a lane for a run of elements and
+             * then moves round to the next, the unbounded list coming after the last lane.
+             */
+            std::int64_t
+            next_lane() noexcept
+            {
+                if (run_length_ < spin_overflow_details::kDefaultMPSCRelaxedRun &&
+                    written(run_index_))
+                {
+                    return lane_index(run_index_);
+                }
+
+                run_length_ = 0;
+
+                auto slots = heads_.size() + 1;
+                auto index = run_index_;
+                for (std::size_t i = 0; i < slots; ++i)
+                {
+                    index = index + 1 != slots ? index + 1 : 0;
+                    if (written(index))
+                    {
+                        run_index_ = index;
+                        return lane_index(index);
+                    }
+                }
+
+                return -1;
+            }
+
+            /* The producer state of lane _t_id. The lanes added since the queue was built are
+             * found through their segment.
+             */
+            producer_block&
+            producer_at(std::size_t _t_id) noexcept
+            {
+                if (_t_id < producers_.size()) { return producers_[_t_id]; }
+
+                auto [segment, offset] = locate(_t_id - producers_.size());
+
+                return segments_[segment].load(std::memory_order_acquire)[offset];
+            }
+
+            const producer_block&
+            producer_at(std::size_t _t_id) const noexcept
+            {
+                return const_cast<spin_overflow_mpsc_queue*>(this)->producer_at(_t_id);
+            }
+
+            /* Adds the lanes for add_lanes() and lease_lanes(), under grow_ */
+            std::uint16_t
+            grow_lanes(std::size_t _count, bool _leasable)
+            {
+                auto first = lanes_.load(std::memory_order_relaxed);
+                assert(first + _count <= spin_overflow_details::kMaxLanes);
+
+                for (auto lane = first; lane < first + _count; ++lane)
+                {
+                    if (lane < producers_.size()) { continue; }
+
+                    auto [segment, offset] = locate(lane - producers_.size());
+                    if (offset == 0)
+                    {
+                        auto  size  = segment_size(segment);
+                        auto* block = allocator_.allocate_object<producer_block>(size);
+                        std::uninitialized_default_construct_n(block, size);
+                        segments_[segment].store(block, std::memory_order_release);
+                    }
+                }
+
+                if (registry_) { registry_->grow(first + _count, _leasable); }
+                lanes_.store(first + _count, std::memory_order_release);
+
+                return static_cast<std::uint16_t>(first);
+            }
+
+            /* The segment and offset of the lane _index past those the queue was built with */
+            static std::pair<std::size_t, std::size_t>
+            locate(std::size_t _index) noexcept
+            {
+                constexpr auto kFirst = spin_overflow_details::kDefaultMPSCLaneSegment;
+
+                auto shifted = _index + kFirst;
+                auto segment = std::bit_width(shifted) - std::bit_width(kFirst);
+
+                return {segment, shifted - (kFirst << segment)};
+            }
+
+            static constexpr std::size_t
+            segment_size(std::size_t _segment) noexcept
+            {
+                return spin_overflow_details::kDefaultMPSCLaneSegment << _segment;
+            }
+
+            /* Consumer only. Sizes its arrays for the lanes added since it last looked */
+            void
+            sync_lanes() noexcept
+            {
+                auto lanes = lanes_.load(std::memory_order_acquire);
+                if (lanes == heads_.size()) { return; }
+
+                heads_.resize(lanes, nullptr);
+                retired_.resize(lanes, nullptr);
+                stamps_.resize(mirror_size(lanes), kEmpty);
+
+                if constexpr (Selection == spin_overflow_details::lane_selection::kTournament)
+                {
+                    tree_ = tree_type(lanes, allocator_.resource());
+                    tree_.reset(stamps_.data());
+                }
+            }
+
+            /* The buffer at the head of a lane, nullptr until its producer has started it */
+            node_buffer*
+            lane_head(std::size_t _index) noexcept
+            {
+                if (!heads_[_index])
+                {
+                    heads_[_index] = producer_at(_index).first_.load(std::memory_order_acquire);
+                }
+
+                return heads_[_index];
+            }
+
+            bool
+            written(std::size_t _index) noexcept
+            {
+                if (_index == heads_.size())
+                {
+                    return extra_head_->next_.load(std::memory_order_acquire) != nullptr;
+                }
+
+                auto* head = lane_head(_index);
+
+                return head && head->load_stamp(head->read_head_) != kEmpty;
+            }
+
+            std::int64_t
+            lane_index(std::size_t _index) const noexcept
+            {
+                return _index == heads_.size() ? kOverflowIndex : std::int64_t(_index);
+            }
+
+            /* An emptied buffer goes back to its lane's pool, or the shared pool if that is full.
+             * Deleted if neither has room.
+             */
+            void
+            hand_back(std::size_t _index, node_buffer* _buffer) noexcept
+            {
+                if (!producer_at(_index).pool_.push(_buffer) && !shared_.push(_buffer))
+                {
+                    node_buffer::destroy(_buffer, allocator_);
+                }
+            }
+
+            void
+            recycle_retired() noexcept
+            {
+                if (!has_retired_) { return; }
+
+                for (std::size_t i = 0; i < retired_.size(); ++i)
+                {
+                    auto* buffer = retired_[i];
+                    while (buffer && buffer != heads_[i])
+                    {
+                        auto* next = buffer->next_;
+                        hand_back(i, buffer);
+                        buffer = next;
+                    }
+
+                    retired_[i] = nullptr;
+                }
+
+                has_retired_ = false;
+            }
+
+            /* The stamp at the head of a non-empty lane can only change when the consumer takes
+             * it, so only the lanes the mirror has as empty need to be read again.
+             */
+            void
+            refresh_empty() noexcept
+            {
+                for (std::size_t i = 0; i < heads_.size(); ++i)
+                {
+                    if (stamps_[i] == kEmpty) { refresh(i); }
+                }
+            }
+
+            void
+            refresh(std::size_t _index) noexcept
+            {
+                auto* head = lane_head(_index);
+
+                assert(!head || head->read_head_ < head->capacity_);
+
+                auto count = head ? head->load_stamp(head->read_head_) : kEmpty;
+
+                if constexpr (Selection == spin_overflow_details::lane_selection::kTournament)
+                {
+                    if (stamps_[_index] != count)
+                    {
+                        stamps_[_index] = count;
+                        tree_.update(stamps_.data(), _index);
+                    }
+
+                    if constexpr (kKnownLanes)
+                    {
+                        auto bit = std::uint64_t{1} << (_index % 64);
+                        if (count == kEmpty) { known_[_index / 64] &= ~bit; }
+                        else
+                        {
+                            known_[_index / 64] |= bit;
+                        }
+                    }
+                }
+                else
+                {
+                    stamps_[_index] = count;
+                }
+            }
+
+            /* refresh_empty() for the tournament: only the lanes in active_ that the mirror has
+             * as empty, a word at a time. Without active_ it falls back to every empty lane.
+             */
+            void
+            refresh_written() noexcept
+            {
+                if constexpr (kKnownLanes)
+                {
+                    for (std::size_t i = 0; i < (heads_.size() + 63) / 64; ++i)
+                    {
+                        auto bits = active_[i].load(std::memory_order_acquire) & ~known_[i];
+                        while (bits)
+                        {
+                            auto index = i * 64 + std::countr_zero(bits);
+                            bits &= bits - 1;
+
+                            /* A lane added since sync_lanes() waits for the next call */
+                            if (index >= heads_.size()) { break; }
+
+                            refresh(index);
+                            if (stamps_[index] == kEmpty) { ++stale_; }
+                        }
+                    }
+
+                    if (deactivating_ && stale_ >= kStaleVisits) { deactivate_drained(); }
+                }
+                else
+                {
+                    refresh_empty();
+                }
+            }
+
+            /* The lane holding the smallest head stamp, {kEmpty, -1} if all are empty */
+            std::pair<std::uint64_t, std::int64_t>
+            select() noexcept
+            {
+                if constexpr (Selection == spin_overflow_details::lane_selection::kTournament)
+                {
+                    refresh_written();
+                    auto index = tree_.winner();
+                    if (stamps_[index] == kEmpty) { return {kEmpty, -1}; }
+
+                    return {stamps_[index], index};
+                }
+                else if constexpr (kActiveLanes)
+                {
+                    auto         min_count = kEmpty;
+                    std::int64_t min_index = -1;
+
+                    for (std::size_t i = 0; i < (heads_.size() + 63) / 64; ++i)
+                    {
+                        auto bits = active_[i].load(std::memory_order_acquire);
+                        while (bits)
+                        {
+                            auto index = i * 64 + std::countr_zero(bits);
+                            bits &= bits - 1;
+
+                            /* A lane added since sync_lanes() waits for the next call */
+                            if (index >= heads_.size()) { break; }
+
+                            if (stamps_[index] == kEmpty) { refresh(index); }
+                            if (stamps_[index] == kEmpty)
+                            {
+                                ++stale_;
+                                continue;
+                            }
+
+                            if (stamps_[index] < min_count)
+                            {
+                                min_count = stamps_[index];
+                                min_index = static_cast<std::int64_t>(index);
+                            }
+                        }
+                    }
+
+                    if (deactivating_ && stale_ >= kStaleVisits) { deactivate_drained(); }
+
+                    return {min_count, min_index};
+                }
+                else
+                {
+                    refresh_empty();
+
+                    return spin_overflow_details::min_stamp(stamps_.data(), stamps_.size());
+                }
+            }
+
+            /* Clears the bits of the lanes found drained, all behind one process wide fence that
+             * pairs with the compiler barrier in activate(). A lane written to in the meantime
+             * gets its bit back.
+             */
+            void
+            deactivate_drained() noexcept
+            {
+                auto words = (heads_.size() + 63) / 64;
+                for (std::size_t i = 0; i < words; ++i)
+                {
+                    auto          bits    = active_[i].load(std::memory_order_relaxed);
+                    std::uint64_t drained = 0;
+                    while (bits)
+                    {
+                        auto index = i * 64 + std::countr_zero(bits);
+                        auto bit   = bits & -bits;
+                        bits &= bits - 1;
+
+                        if (index >= heads_.size()) { break; }
+                        if (stamps_[index] != kEmpty) { continue; }
+
+                        producer_at(index).idle_.store(true, std::memory_order_relaxed);
+                        drained |= bit;
+                    }
+
+                    drained_[i] = drained;
+                    if (drained) { active_[i].fetch_and(~drained, std::memory_order_relaxed); }
+                }
+
+                spin_overflow_details::process_fence();
+
+                for (std::size_t i = 0; i < words; ++i)
+                {
+                    for (auto bits = drained_[i]; bits; bits &= bits - 1)
+                    {
+                        auto index = i * 64 + std::countr_zero(bits);
+
+                        refresh(index);
+                        if (stamps_[index] == kEmpty) { continue; }
+
+                        producer_at(index).idle_.store(false, std::memory_order_relaxed);
+                        active_[i].fetch_or(bits & -bits, std::memory_order_relaxed);
+                    }
+                }
+
+                stale_ = 0;
+            }
+
+            /* The tournament needs a leaf, padded as empty, for every power of two slot. There is
+             * always at least one slot so the mirror can be read without checking its size.
+             */
+            static std::size_t
+            mirror_size(std::size_t _num_threads) noexcept
+            {
+                if constexpr (Selection == spin_overflow_details::lane_selection::kTournament)
+                {
+                    return std::bit_ceil(std::max<std::size_t>(_num_threads, 1));
+                }
+                else
+                {
+                    return std::max<std::size_t>(_num_threads, 1);
+                }
+            }
+
+            /* Where the buffers, overflow nodes and arrays come from, read only */
+            std::pmr::polymorphic_allocator<> allocator_;
+
+            /* Which lanes are leased to threads, shared with the threads' leases. Made by the
+             * first lease_lanes(), leasing_ is set once it exists.
+             */
+            std::shared_ptr<spin_overflow_details::lane_registry> registry_;
+            std::atomic<bool>                                     leasing_;
+
+            /* Consumer only */
+            buffer_list heads_ alignas(kAlignment);
+
+            /* Consumer side mirror of the stamp at the head of each lane */
+            stamp_mirror                    stamps_;
+            [[no_unique_address]] tree_type tree_;
+
+            /* Relaxed order: the lane being taken from and how many have been taken from it */
+            std::size_t run_index_;
+            std::size_t run_length_;
+
+            /* The first buffer a batch emptied in each lane */
+            buffer_list retired_;
+            bool        has_retired_;
+
+            /* A bit for each lane the mirror has as written, kKnownLanes only */
+            stamp_mirror known_;
+
+            /* The lanes deactivate_drained() took out of the bitmap, and the visits to drained
+             * lanes since it last ran. kActiveLanes only, and only where process_fence() can be
+             * used.
+             */
+            stamp_mirror drained_;
+            std::size_t  stale_;
+            bool         deactivating_;
+
+            /* The element peek() found, until pop() takes it */
+            bool          peeked_;
+            std::int64_t  peek_index_;
+
+            extra_node* extra_head_ alignas(kAlignment);
+
+            [[no_unique_address]] shared_pool_type shared_;
+
+            producer_list producers_ alignas(kAlignment);
+
+            /* The lanes added since the queue was built, in segments of kDefaultMPSCLaneSegment
+             * doubling. A segment is never moved, so a producer can hold on to its block.
+             */
+            std::atomic<producer_block*> segments_[kSegments];
+            std::atomic<std::size_t>     lanes_;
+            std::mutex                   grow_;
+
+            /* A bit for each lane written to since the consumer last found it drained, sized for
+             * kMaxLanes so adding lanes never moves it under the producers. kActiveLanes only.
+             */
+            active_list active_;
+
+            std::atomic<std::uint64_t> up_to_ alignas(kAlignment);
 
             std::atomic<extra_node*> extra_tail_ alignas(kAlignment);
 
@@ -0,0 +1,149 @@
+/*
+ * [....... [..[..[.. [..
+ *        [..  [..[.    [..
+ *       [..   [..[.     [..
+ *     [..     [..[... [.
+ *    [..      [..[.     [..
+ *  [..        [..[.      [.
+ * [...........[..[.... [..
+ *
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Donald-Rupin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ *
+ *  @file variant_mpsc_queue.hpp
+ *
+ */
+
+#ifndef ZIB_VARIANT_MPSC_QUEUE_HPP_
+#define ZIB_VARIANT_MPSC_QUEUE_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include "zib/wait_mpsc_queue.hpp"
+
+namespace zib {
+
+    /* A wait_mpsc_queue of events of several types, each held inline in its lane's buffer as a
+     * std::variant of Ts. Producers construct an event in place, the consumer visits it where it
+     * is and destroys it, so there is no allocation and no pointer to chase per event.
+     *
+     * The payloads are laid out split, so a lane's stamps stay dense however large the biggest
+     * of Ts is.
+     */
+    template <typename... Ts>
+    class variant_mpsc_queue {
+
+        public:
+
+            using value_type = std::variant<Ts...>;
+
+            using queue_type = wait_mpsc_queue<
+                value_type,
+                wait_details::deconstruct_noop<value_type>,
+                wait_details::kDefaultMPSCSize,
+                wait_details::kDefaultMPSCAllocationBufferSize,
+                {.layout_ = wait_details::node_layout::kSplit}>;
+
+            variant_mpsc_queue(
+                std::uint64_t              _num_threads,
+                std::pmr::memory_resource* _resource = std::pmr::new_delete_resource())
+                : queue_(_num_threads, _resource)
+            { }
+
+            /* Constructs an event of type U from _args in place at the tail of lane _t_id */
+            template <typename U, typename... Args>
+            void
+            emplace(std::uint16_t _t_id, Args&&... _args) noexcept
+            {
+                queue_.emplace(_t_id, std::in_place_type<U>, std::forward<Args>(_args)...);
+            }
+
+            template <typename U>
+            void
+            enqueue(U&& _event, std::uint16_t _t_id) noexcept
+            {
+                emplace<std::remove_cvref_t<U>>(_t_id, std::forward<U>(_event));
+            }
+
+            /* Calls _visitor with the next event, as its own type, where it sits in the lane and
+             * then destroys it. Blocks until there is one.
+             */
+            template <typename Visitor>
+            decltype(auto)
+            visit(Visitor&& _visitor)
+            {
+                auto&  event = queue_.peek();
+                popper pop { queue_ };
+
+                return std::visit(std::forward<Visitor>(_visitor), event);
+            }
+
+            /* Calls _visitor with every event that is available, in the order visit() would see
+             * them, each where it sits in the lane. Returns how many there were, blocking until
+             * there is at least one.
+             */
+            template <typename Visitor>
+            std::size_t
+            visit_all(Visitor&& _visitor)
+            {
+                std::size_t seen = 0;
+                for (auto* event = &queue_.peek(); event; event = queue_.try_peek())
+                {
+                    popper pop { queue_ };
+
+                    std::visit(_visitor, *event);
+                    ++seen;
+                }
+
+                return seen;
+            }
+
+            /* The queue underneath, for what isn't wrapped here */
+            queue_type&
+            queue() noexcept
+            {
+                return queue_;
+            }
+
+        private:
+
+            /* Pops the peeked event once the visitor has returned, whatever it returns */
+            struct popper {
+
+                    ~popper() { queue_.pop(); }
+
+                    queue_type& queue_;
+            };
+
+            queue_type queue_;
+    };
+
+}   // namespace zib
+
+#endif /* ZIB_VARIANT_MPSC_QUEUE_HPP_ */
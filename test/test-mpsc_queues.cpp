@@ -34,23 +34,84 @@
  *
  */
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <numeric>
 #include <optional>
+#include <random>
+#include <semaphore>
+#include <span>
+#include <string>
 #include <thread>
 #include <type_traits>
+#include <utility>
+#include <vector>
 
+#include "zib/byte_mpsc_queue.hpp"
+#include "zib/hugepage_resource.hpp"
 #include "zib/overflow_mpsc_queue.hpp"
 #include "zib/spin_mpsc_queue.hpp"
 #include "zib/wait_mpsc_queue.hpp"
 #include "zib/spin_overflow_mpsc_queue.hpp"
+#include "zib/variant_mpsc_queue.hpp"
 
 namespace zib::test {
 
+    /* wait queues block and return T, spin queues return std::optional<T> */
+    template <typename Queue>
+    static constexpr bool is_blocking = std::is_same_v<
+        decltype(std::declval<Queue&>().dequeue()),
+        typename Queue::value_type>;
+
+    template <typename Queue>
+    static constexpr bool is_overflow =
+        requires(Queue& _queue, typename Queue::value_type _value) {
+            _queue.safe_enqueue(std::move(_value), 0);
+        };
+
+    /* The overflow queues name their lane checked enqueue safe_enqueue */
+    template <typename Queue>
+    void
+    push(Queue& _queue, typename Queue::value_type _value, std::uint16_t _t_id)
+    {
+        if constexpr (is_overflow<Queue>) { _queue.safe_enqueue(std::move(_value), _t_id); }
+        else
+        {
+            _queue.enqueue(std::move(_value), _t_id);
+        }
+    }
+
+    template <typename Queue>
+    void
+    push_bulk(
+        Queue&                                        _queue,
+        std::span<const typename Queue::value_type> _values,
+        std::uint16_t                                 _t_id)
+    {
+        if constexpr (is_overflow<Queue>) { _queue.safe_enqueue_bulk(_values, _t_id); }
+        else
+        {
+            _queue.enqueue_bulk(_values, _t_id);
+        }
+    }
+
+    int
+    test_min_stamp();
+
     template <typename Queue>
     int
     test_single_thread();
@@ -59,15 +120,579 @@ namespace zib::test {
     int
     test_multi_thread();
 
+    template <typename Queue>
+    int
+    test_lane_order(
+        std::size_t _lanes,
+        std::size_t _producers,
+        bool        _bulk  = false,
+        std::size_t _batch = 1);
+
+    template <typename Queue>
+    int
+    test_bulk();
+
+    template <typename Queue>
+    int
+    test_stats();
+
+    template <typename Queue>
+    int
+    test_stamp_block();
+
+    template <typename Queue>
+    int
+    test_recycle();
+
+    template <typename Queue>
+    int
+    test_shared_pool();
+
+    template <typename Queue>
+    int
+    test_memory_resource();
+
+    int
+    test_hugepage_resource();
+
+    template <typename Queue>
+    int
+    test_lazy_lanes();
+
+    template <typename Queue>
+    int
+    test_reserve_trim();
+
+    template <typename Queue>
+    int
+    test_adaptive();
+
+    template <typename Queue>
+    int
+    test_emplace();
+
+    template <typename Queue>
+    int
+    test_prepare();
+
+    template <typename Queue>
+    int
+    test_peek();
+
+    template <typename Queue>
+    int
+    test_peek_take();
+
+    int
+    test_byte_queue();
+
+    int
+    test_byte_lane_order(std::size_t _producers);
+
+    int
+    test_byte_max_size();
+
+    int
+    test_variant_queue();
+
+    int
+    test_variant_in_place();
+
+    template <typename Queue>
+    int
+    test_lease();
+
+    template <typename Queue>
+    int
+    test_lease_full();
+
+    template <typename Queue>
+    int
+    test_lease_outlives();
+
+    template <typename Queue>
+    int
+    test_lease_mixed();
+
+    template <typename Queue>
+    int
+    test_add_lanes();
+
+    using split_spin_queue = spin_mpsc_queue<
+        std::uint64_t,
+        spin_details::deconstruct_noop<std::uint64_t>,
+        spin_details::kDefaultMPSCSize,
+        spin_details::kDefaultMPSCAllocationBufferSize,
+        {.layout_ = spin_details::node_layout::kSplit}>;
+
+    using split_wait_queue = wait_mpsc_queue<
+        std::uint64_t,
+        wait_details::deconstruct_noop<std::uint64_t>,
+        wait_details::kDefaultMPSCSize,
+        wait_details::kDefaultMPSCAllocationBufferSize,
+        {.layout_ = wait_details::node_layout::kSplit}>;
+
+    using split_overflow_queue = overflow_mpsc_queue<
+        std::uint64_t,
+        overflow_details::deconstruct_noop<std::uint64_t>,
+        overflow_details::kDefaultMPSCSize,
+        overflow_details::kDefaultMPSCAllocationBufferSize,
+        {.layout_ = overflow_details::node_layout::kSplit}>;
+
+    using split_spin_overflow_queue = spin_overflow_mpsc_queue<
+        std::uint64_t,
+        spin_overflow_details::deconstruct_noop<std::uint64_t>,
+        spin_overflow_details::kDefaultMPSCSize,
+        spin_overflow_details::kDefaultMPSCAllocationBufferSize,
+        {.layout_ = spin_overflow_details::node_layout::kSplit}>;
+
+    using tournament_spin_queue = spin_mpsc_queue<
+        std::uint64_t,
+        spin_details::deconstruct_noop<std::uint64_t>,
+        spin_details::kDefaultMPSCSize,
+        spin_details::kDefaultMPSCAllocationBufferSize,
+        {.selection_ = spin_details::lane_selection::kTournament}>;
+
+    using tournament_wait_queue = wait_mpsc_queue<
+        std::uint64_t,
+        wait_details::deconstruct_noop<std::uint64_t>,
+        wait_details::kDefaultMPSCSize,
+        wait_details::kDefaultMPSCAllocationBufferSize,
+        {.selection_ = wait_details::lane_selection::kTournament}>;
+
+    using tournament_overflow_queue = overflow_mpsc_queue<
+        std::uint64_t,
+        overflow_details::deconstruct_noop<std::uint64_t>,
+        overflow_details::kDefaultMPSCSize,
+        overflow_details::kDefaultMPSCAllocationBufferSize,
+        {.selection_ = overflow_details::lane_selection::kTournament}>;
+
+    using tournament_spin_overflow_queue = spin_overflow_mpsc_queue<
+        std::uint64_t,
+        spin_overflow_details::deconstruct_noop<std::uint64_t>,
+        spin_overflow_details::kDefaultMPSCSize,
+        spin_overflow_details::kDefaultMPSCAllocationBufferSize,
+        {.selection_ = spin_overflow_details::lane_selection::kTournament}>;
+
+    using active_spin_queue = spin_mpsc_queue<
+        std::uint64_t,
+        spin_details::deconstruct_noop<std::uint64_t>,
+        spin_details::kDefaultMPSCSize,
+        spin_details::kDefaultMPSCAllocationBufferSize,
+        {.selection_ = spin_details::lane_selection::kActive}>;
+
+    using active_wait_queue = wait_mpsc_queue<
+        std::uint64_t,
+        wait_details::deconstruct_noop<std::uint64_t>,
+        wait_details::kDefaultMPSCSize,
+        wait_details::kDefaultMPSCAllocationBufferSize,
+        {.selection_ = wait_details::lane_selection::kActive}>;
+
+    using active_overflow_queue = overflow_mpsc_queue<
+        std::uint64_t,
+        overflow_details::deconstruct_noop<std::uint64_t>,
+        overflow_details::kDefaultMPSCSize,
+        overflow_details::kDefaultMPSCAllocationBufferSize,
+        {.selection_ = overflow_details::lane_selection::kActive}>;
+
+    using active_spin_overflow_queue = spin_overflow_mpsc_queue<
+        std::uint64_t,
+        spin_overflow_details::deconstruct_noop<std::uint64_t>,
+        spin_overflow_details::kDefaultMPSCSize,
+        spin_overflow_details::kDefaultMPSCAllocationBufferSize,
+        {.selection_ = spin_overflow_details::lane_selection::kActive}>;
+
+    using stats_spin_queue = spin_mpsc_queue<
+        std::uint64_t,
+        spin_details::deconstruct_noop<std::uint64_t>,
+        8,
+        4,
+        {.stats_ = true}>;
+
+    using stats_wait_queue = wait_mpsc_queue<
+        std::uint64_t,
+        wait_details::deconstruct_noop<std::uint64_t>,
+        8,
+        4,
+        {.stats_ = true}>;
+
+    using stats_overflow_queue = overflow_mpsc_queue<
+        std::uint64_t,
+        overflow_details::deconstruct_noop<std::uint64_t>,
+        8,
+        4,
+        {.stats_ = true}>;
+
+    using stats_spin_overflow_queue = spin_overflow_mpsc_queue<
+        std::uint64_t,
+        spin_overflow_details::deconstruct_noop<std::uint64_t>,
+        8,
+        4,
+        {.stats_ = true}>;
+
+    using relaxed_spin_queue = spin_mpsc_queue<
+        std::uint64_t,
+        spin_details::deconstruct_noop<std::uint64_t>,
+        spin_details::kDefaultMPSCSize,
+        spin_details::kDefaultMPSCAllocationBufferSize,
+        {.ordering_ = spin_details::ordering::kRelaxed}>;
+
+    using relaxed_wait_queue = wait_mpsc_queue<
+        std::uint64_t,
+        wait_details::deconstruct_noop<std::uint64_t>,
+        wait_details::kDefaultMPSCSize,
+        wait_details::kDefaultMPSCAllocationBufferSize,
+        {.ordering_ = wait_details::ordering::kRelaxed}>;
+
+    using relaxed_overflow_queue = overflow_mpsc_queue<
+        std::uint64_t,
+        overflow_details::deconstruct_noop<std::uint64_t>,
+        overflow_details::kDefaultMPSCSize,
+        overflow_details::kDefaultMPSCAllocationBufferSize,
+        {.ordering_ = overflow_details::ordering::kRelaxed}>;
+
+    using relaxed_spin_overflow_queue = spin_overflow_mpsc_queue<
+        std::uint64_t,
+        spin_overflow_details::deconstruct_noop<std::uint64_t>,
+        spin_overflow_details::kDefaultMPSCSize,
+        spin_overflow_details::kDefaultMPSCAllocationBufferSize,
+        {.ordering_ = spin_overflow_details::ordering::kRelaxed}>;
+
+    using timestamp_wait_queue = wait_mpsc_queue<
+        std::uint64_t,
+        wait_details::deconstruct_noop<std::uint64_t>,
+        wait_details::kDefaultMPSCSize,
+        wait_details::kDefaultMPSCAllocationBufferSize,
+        {.ordering_ = wait_details::ordering::kTimestamp}>;
+
+    using timestamp_overflow_queue = overflow_mpsc_queue<
+        std::uint64_t,
+        overflow_details::deconstruct_noop<std::uint64_t>,
+        overflow_details::kDefaultMPSCSize,
+        overflow_details::kDefaultMPSCAllocationBufferSize,
+        {.ordering_ = overflow_details::ordering::kTimestamp}>;
+
+    using block_wait_queue = wait_mpsc_queue<
+        std::uint64_t,
+        wait_details::deconstruct_noop<std::uint64_t>,
+        wait_details::kDefaultMPSCSize,
+        wait_details::kDefaultMPSCAllocationBufferSize,
+        {.stamp_block_ = 4}>;
+
+    using block_overflow_queue = overflow_mpsc_queue<
+        std::uint64_t,
+        overflow_details::deconstruct_noop<std::uint64_t>,
+        overflow_details::kDefaultMPSCSize,
+        overflow_details::kDefaultMPSCAllocationBufferSize,
+        {.stamp_block_ = 4}>;
+
+    using shared_wait_queue = wait_mpsc_queue<
+        std::shared_ptr<int>,
+        wait_details::deconstruct_noop<std::shared_ptr<int>>,
+        8,
+        4>;
+
+    using shared_spin_queue = spin_mpsc_queue<
+        std::shared_ptr<int>,
+        spin_details::deconstruct_noop<std::shared_ptr<int>>,
+        8,
+        4>;
+
+    using pooled_wait_queue = wait_mpsc_queue<
+        std::uint64_t,
+        wait_details::deconstruct_noop<std::uint64_t>,
+        8,
+        2,
+        {.stats_ = true, .shared_pool_ = 8}>;
+
+    using pooled_spin_queue = spin_mpsc_queue<
+        std::uint64_t,
+        spin_details::deconstruct_noop<std::uint64_t>,
+        8,
+        2,
+        {.stats_ = true, .shared_pool_ = 8}>;
+
+    /* The time the adaptive queues read, stepped by hand */
+    inline std::chrono::steady_clock::time_point fake_time;
+
+    inline std::chrono::steady_clock::time_point
+    fake_now() noexcept
+    {
+        return fake_time;
+    }
+
+    constexpr wait_details::lane_clock          wait_fake_clock{&fake_now};
+    constexpr spin_details::lane_clock          spin_fake_clock{&fake_now};
+    constexpr overflow_details::lane_clock      overflow_fake_clock{&fake_now};
+    constexpr spin_overflow_details::lane_clock spin_overflow_fake_clock{&fake_now};
+
+    using adaptive_wait_queue = wait_mpsc_queue<
+        std::uint64_t,
+        wait_details::deconstruct_noop<std::uint64_t>,
+        64,
+        4,
+        {.stats_ = true, .min_buffer_ = 4, .clock_ = &wait_fake_clock}>;
+
+    using adaptive_spin_queue = spin_mpsc_queue<
+        std::uint64_t,
+        spin_details::deconstruct_noop<std::uint64_t>,
+        64,
+        4,
+        {.layout_     = spin_details::node_layout::kSplit,
+         .stats_      = true,
+         .min_buffer_ = 4,
+         .clock_      = &spin_fake_clock}>;
+
+    using adaptive_overflow_queue = overflow_mpsc_queue<
+        std::uint64_t,
+        overflow_details::deconstruct_noop<std::uint64_t>,
+        64,
+        4,
+        {.layout_     = overflow_details::node_layout::kSplit,
+         .stats_      = true,
+         .min_buffer_ = 4,
+         .clock_      = &overflow_fake_clock}>;
+
+    using adaptive_spin_overflow_queue = spin_overflow_mpsc_queue<
+        std::uint64_t,
+        spin_overflow_details::deconstruct_noop<std::uint64_t>,
+        64,
+        4,
+        {.stats_ = true, .min_buffer_ = 4, .clock_ = &spin_overflow_fake_clock}>;
+
+    /* Move only, and without a default constructor */
+    struct owned {
+
+            owned(std::uint64_t _value, std::uint64_t _check)
+                : value_(std::make_unique<std::uint64_t>(_value)), check_(_check)
+            { }
+
+            std::unique_ptr<std::uint64_t> value_;
+            std::uint64_t                  check_;
+    };
+
+    /* Counts how many times it is moved */
+    struct move_counted {
+
+            move_counted(std::uint64_t _value, std::size_t* _moves)
+                : value_(_value), moves_(_moves)
+            { }
+
+            move_counted(move_counted&& _other) noexcept
+                : value_(_other.value_), moves_(_other.moves_)
+            {
+                ++*moves_;
+            }
+
+            move_counted&
+            operator=(move_counted&& _other) noexcept
+            {
+                value_ = _other.value_;
+                moves_ = _other.moves_;
+                ++*moves_;
+                return *this;
+            }
+
+            std::uint64_t value_;
+            std::size_t*  moves_;
+    };
+
+    using owned_wait_queue = wait_mpsc_queue<owned, wait_details::deconstruct_noop<owned>, 8, 4>;
+
+    using owned_spin_queue = spin_mpsc_queue<
+        owned,
+        spin_details::deconstruct_noop<owned>,
+        8,
+        4,
+        {.layout_ = spin_details::node_layout::kSplit}>;
+
+    using owned_overflow_queue =
+        overflow_mpsc_queue<owned, overflow_details::deconstruct_noop<owned>, 8, 4>;
+
+    using owned_spin_overflow_queue = spin_overflow_mpsc_queue<
+        owned,
+        spin_overflow_details::deconstruct_noop<owned>,
+        8,
+        4,
+        {.layout_ = spin_overflow_details::node_layout::kSplit}>;
+
+    /* What the calling thread allocates through the global operator new while track_global is
+     * set, to check nothing a queue allocates gets past its memory resource
+     */
+    inline thread_local bool        track_global       = false;
+    inline thread_local std::size_t global_allocations = 0;
+
+    /* Counts what is outstanding, on top of new and delete */
+    class counting_resource : public std::pmr::memory_resource {
+
+        public:
+
+            std::size_t allocations_ = 0;
+            std::size_t outstanding_ = 0;
+
+        private:
+
+            void*
+            do_allocate(std::size_t _bytes, std::size_t _alignment) override
+            {
+                std::lock_guard lock(mutex_);
+                ++allocations_;
+                outstanding_ += _bytes;
+
+                /* The upstream is the global heap, which isn't an escape */
+                auto tracked = std::exchange(track_global, false);
+                auto ptr     = std::pmr::new_delete_resource()->allocate(_bytes, _alignment);
+                track_global = tracked;
+
+                return ptr;
+            }
+
+            void
+            do_deallocate(void* _ptr, std::size_t _bytes, std::size_t _alignment) override
+            {
+                std::lock_guard lock(mutex_);
+                outstanding_ -= _bytes;
+
+                std::pmr::new_delete_resource()->deallocate(_ptr, _bytes, _alignment);
+            }
+
+            bool
+            do_is_equal(const std::pmr::memory_resource& _other) const noexcept override
+            {
+                return this == &_other;
+            }
+
+            std::mutex mutex_;
+    };
+
     int
     run_test()
     {
-        return test_single_thread<spin_mpsc_queue<std::uint64_t>>() ||
+        return test_min_stamp() || test_single_thread<spin_mpsc_queue<std::uint64_t>>() ||
                test_single_thread<wait_mpsc_queue<std::uint64_t>>() ||
                test_multi_thread<spin_mpsc_queue<std::uint64_t>>() ||
                test_multi_thread<wait_mpsc_queue<std::uint64_t>>() ||
                test_multi_thread<overflow_mpsc_queue<std::uint64_t>>()||
-               test_multi_thread<spin_overflow_mpsc_queue<std::uint64_t>>();
+               test_multi_thread<spin_overflow_mpsc_queue<std::uint64_t>>() ||
+               test_single_thread<split_spin_queue>() ||
+               test_single_thread<split_wait_queue>() ||
+               test_multi_thread<split_spin_queue>() ||
+               test_multi_thread<split_wait_queue>() ||
+               test_multi_thread<split_overflow_queue>() ||
+               test_multi_thread<split_spin_overflow_queue>() ||
+               test_single_thread<tournament_spin_queue>() ||
+               test_single_thread<tournament_wait_queue>() ||
+               test_multi_thread<tournament_wait_queue>() ||
+               test_multi_thread<tournament_overflow_queue>() ||
+               test_lane_order<wait_mpsc_queue<std::uint64_t>>(37, 5) ||
+               test_lane_order<spin_mpsc_queue<std::uint64_t>>(37, 5) ||
+               test_lane_order<tournament_wait_queue>(37, 5) ||
+               test_lane_order<tournament_spin_queue>(37, 5) ||
+               test_lane_order<tournament_overflow_queue>(37, 5) ||
+               test_lane_order<tournament_spin_overflow_queue>(37, 5) ||
+               test_bulk<wait_mpsc_queue<std::uint64_t>>() ||
+               test_bulk<spin_mpsc_queue<std::uint64_t>>() ||
+               test_bulk<overflow_mpsc_queue<std::uint64_t>>() ||
+               test_bulk<spin_overflow_mpsc_queue<std::uint64_t>>() ||
+               test_lane_order<wait_mpsc_queue<std::uint64_t>>(16, 4, true) ||
+               test_lane_order<spin_mpsc_queue<std::uint64_t>>(16, 4, true) ||
+               test_lane_order<overflow_mpsc_queue<std::uint64_t>>(3, 4, true) ||
+               test_lane_order<spin_overflow_mpsc_queue<std::uint64_t>>(3, 4, true) ||
+               test_lane_order<wait_mpsc_queue<std::uint64_t>>(8, 4, false, 300) ||
+               test_lane_order<spin_mpsc_queue<std::uint64_t>>(8, 4, true, 300) ||
+               test_lane_order<overflow_mpsc_queue<std::uint64_t>>(3, 4, true, 300) ||
+               test_lane_order<spin_overflow_mpsc_queue<std::uint64_t>>(3, 4, false, 300) ||
+               test_stats<stats_spin_queue>() || test_stats<stats_wait_queue>() ||
+               test_stats<stats_overflow_queue>() || test_stats<stats_spin_overflow_queue>() ||
+               test_lane_order<relaxed_wait_queue>(8, 4) ||
+               test_lane_order<relaxed_spin_queue>(8, 4) ||
+               test_lane_order<relaxed_wait_queue>(8, 4, true, 300) ||
+               test_lane_order<relaxed_spin_queue>(8, 4, true, 300) ||
+               test_lane_order<relaxed_overflow_queue>(3, 4) ||
+               test_lane_order<relaxed_spin_overflow_queue>(3, 4) ||
+               test_lane_order<relaxed_overflow_queue>(3, 4, true, 300) ||
+               test_lane_order<relaxed_spin_overflow_queue>(3, 4, true, 300) ||
+               test_single_thread<timestamp_wait_queue>() || test_bulk<timestamp_wait_queue>() ||
+               test_bulk<timestamp_overflow_queue>() ||
+               test_lane_order<timestamp_wait_queue>(8, 4) ||
+               test_lane_order<timestamp_overflow_queue>(3, 4) ||
+               test_lane_order<timestamp_wait_queue>(8, 4, true, 300) ||
+               test_lane_order<timestamp_overflow_queue>(3, 4, true, 300) ||
+               test_stamp_block<block_wait_queue>() || test_stamp_block<block_overflow_queue>() ||
+               test_single_thread<block_wait_queue>() ||
+               test_lane_order<block_wait_queue>(8, 4) ||
+               test_lane_order<block_overflow_queue>(3, 4) ||
+               test_lane_order<block_wait_queue>(8, 4, true, 300) ||
+               test_lane_order<block_overflow_queue>(3, 4, true, 300) ||
+               test_recycle<shared_wait_queue>() || test_recycle<shared_spin_queue>() ||
+               test_shared_pool<pooled_wait_queue>() || test_shared_pool<pooled_spin_queue>() ||
+               test_memory_resource<stats_wait_queue>() ||
+               test_memory_resource<stats_spin_queue>() ||
+               test_memory_resource<stats_overflow_queue>() ||
+               test_memory_resource<stats_spin_overflow_queue>() ||
+               test_memory_resource<pooled_wait_queue>() ||
+               test_memory_resource<pooled_spin_queue>() || test_hugepage_resource() ||
+               test_memory_resource<active_wait_queue>() ||
+               test_memory_resource<active_spin_queue>() ||
+               test_memory_resource<active_overflow_queue>() ||
+               test_memory_resource<active_spin_overflow_queue>() ||
+               test_lazy_lanes<stats_wait_queue>() || test_lazy_lanes<stats_spin_queue>() ||
+               test_lazy_lanes<stats_overflow_queue>() ||
+               test_lazy_lanes<stats_spin_overflow_queue>() ||
+               test_reserve_trim<stats_wait_queue>() || test_reserve_trim<stats_spin_queue>() ||
+               test_reserve_trim<stats_overflow_queue>() ||
+               test_reserve_trim<stats_spin_overflow_queue>() ||
+               test_reserve_trim<pooled_wait_queue>() || test_reserve_trim<pooled_spin_queue>() ||
+               test_single_thread<adaptive_wait_queue>() ||
+               test_single_thread<adaptive_spin_queue>() ||
+               test_multi_thread<adaptive_wait_queue>() ||
+               test_multi_thread<adaptive_overflow_queue>() ||
+               test_lane_order<adaptive_wait_queue>(8, 4, true, 300) ||
+               test_lane_order<adaptive_spin_queue>(8, 4) ||
+               test_lane_order<adaptive_overflow_queue>(3, 4, true, 300) ||
+               test_lane_order<adaptive_spin_overflow_queue>(3, 4) ||
+               test_adaptive<adaptive_wait_queue>() || test_adaptive<adaptive_spin_queue>() ||
+               test_adaptive<adaptive_overflow_queue>() ||
+               test_adaptive<adaptive_spin_overflow_queue>() ||
+               test_emplace<owned_wait_queue>() || test_emplace<owned_spin_queue>() ||
+               test_emplace<owned_overflow_queue>() || test_emplace<owned_spin_overflow_queue>() ||
+               test_prepare<stats_wait_queue>() || test_prepare<stats_spin_queue>() ||
+               test_prepare<stats_overflow_queue>() || test_prepare<stats_spin_overflow_queue>() ||
+               test_peek<owned_wait_queue>() || test_peek<owned_spin_queue>() ||
+               test_peek<owned_overflow_queue>() || test_peek<owned_spin_overflow_queue>() ||
+               test_peek_take<owned_wait_queue>() || test_peek_take<owned_spin_queue>() ||
+               test_peek_take<owned_overflow_queue>() ||
+               test_peek_take<owned_spin_overflow_queue>() ||
+               test_byte_queue() || test_byte_lane_order(4) || test_byte_max_size() ||
+               test_variant_queue() ||
+               test_variant_in_place() ||
+               test_lease<stats_wait_queue>() || test_lease<stats_spin_queue>() ||
+               test_lease<stats_overflow_queue>() || test_lease<stats_spin_overflow_queue>() ||
+               test_lease_full<stats_wait_queue>() || test_lease_full<stats_spin_queue>() ||
+               test_lease_full<stats_overflow_queue>() ||
+               test_lease_full<stats_spin_overflow_queue>() ||
+               test_lease_outlives<wait_mpsc_queue<std::uint64_t>>() ||
+               test_lease_outlives<overflow_mpsc_queue<std::uint64_t>>() ||
+               test_lease_mixed<stats_wait_queue>() || test_lease_mixed<stats_spin_queue>() ||
+               test_lease_mixed<stats_overflow_queue>() ||
+               test_lease_mixed<stats_spin_overflow_queue>() ||
+               test_add_lanes<stats_wait_queue>() || test_add_lanes<stats_spin_queue>() ||
+               test_add_lanes<stats_overflow_queue>() ||
+               test_add_lanes<stats_spin_overflow_queue>() ||
+               test_add_lanes<tournament_wait_queue>() ||
+               test_add_lanes<tournament_spin_queue>() ||
+               test_single_thread<active_wait_queue>() ||
+               test_single_thread<active_spin_queue>() ||
+               test_multi_thread<active_wait_queue>() ||
+               test_multi_thread<active_overflow_queue>() ||
+               test_multi_thread<active_spin_overflow_queue>() ||
+               test_lane_order<active_wait_queue>(37, 5) ||
+               test_lane_order<active_spin_queue>(37, 5) ||
+               test_lane_order<active_overflow_queue>(3, 4, true, 300) ||
+               test_lane_order<active_spin_overflow_queue>(3, 4, true, 300) ||
+               test_lane_order<active_wait_queue>(8, 4, true, 300) ||
+               test_bulk<active_wait_queue>() || test_bulk<active_spin_queue>() ||
+               test_add_lanes<active_wait_queue>() || test_add_lanes<active_spin_queue>();
     }
 
     inline std::uint16_t
@@ -87,6 +712,57 @@ namespace zib::test {
         return count;
     }
 
+    int
+    test_min_stamp()
+    {
+        static constexpr auto kEmpty = std::numeric_limits<std::uint64_t>::max();
+
+        std::mt19937_64 gen(42);
+
+        for (std::size_t size = 0; size < 67; ++size)
+        {
+            for (std::size_t round = 0; round < 100; ++round)
+            {
+                std::vector<std::uint64_t> stamps(size);
+                for (auto& s : stamps)
+                {
+                    /* Plenty of empties and duplicates, and values either side of the sign bit */
+                    switch (gen() % 4)
+                    {
+                        case 0:
+                            s = kEmpty;
+                            break;
+                        case 1:
+                            s = gen() % 8;
+                            break;
+                        case 2:
+                            s = (std::uint64_t(1) << 63) + gen() % 8;
+                            break;
+                        default:
+                            s = gen();
+                    }
+                }
+
+                auto         expected_count = kEmpty;
+                std::int64_t expected_index = -1;
+                for (std::size_t i = 0; i < size; ++i)
+                {
+                    if (stamps[i] < expected_count)
+                    {
+                        expected_count = stamps[i];
+                        expected_index = i;
+                    }
+                }
+
+                auto [count, index] = wait_details::min_stamp(stamps.data(), stamps.size());
+
+                if (count != expected_count || index != expected_index) { return true; }
+            }
+        }
+
+        return false;
+    }
+
     template <typename Queue>
     int
     test_single_thread()
@@ -102,7 +778,7 @@ namespace zib::test {
 
             size_t element = 0;
 
-            if constexpr (std::is_same_v<Queue, wait_mpsc_queue<typename Queue::value_type>>)
+            if constexpr (is_blocking<Queue>)
             {
 
                 element = queue.dequeue();
@@ -118,7 +794,7 @@ namespace zib::test {
 
             if (i != element) { return true; }
 
-            if constexpr (std::is_same_v<Queue, wait_mpsc_queue<typename Queue::value_type>>)
+            if constexpr (is_blocking<Queue>)
             {
 
                 element = queue.dequeue();
@@ -145,12 +821,8 @@ namespace zib::test {
         static constexpr auto kElements      = 1000000;
         static constexpr auto kNumberThreads = 16;
 
-        static constexpr bool is_overflow =
-            std::is_same_v<Queue, overflow_mpsc_queue<typename Queue::value_type>> ||
-            std::is_same_v<Queue, spin_overflow_mpsc_queue<typename Queue::value_type>>;
-
         size_t n_threads = kNumberThreads;
-        if constexpr (is_overflow) { n_threads /= 2; }
+        if constexpr (is_overflow<Queue>) { n_threads /= 2; }
 
         std::array<std::jthread, kNumberThreads> threads;
         Queue                                    queue(n_threads);
@@ -166,7 +838,7 @@ namespace zib::test {
                     using namespace std::chrono_literals;
                     for (size_t i = 0; i < kElements; ++i)
                     {
-                        if constexpr (is_overflow)
+                        if constexpr (is_overflow<Queue>)
                         {
                             queue.safe_enqueue(i + (kElements * index), index - 1);
                         }
@@ -195,15 +867,13 @@ namespace zib::test {
                 size_t amount = 0;
                 while (amount != kElements * kNumberThreads)
                 {
-                    if constexpr (
-                        std::is_same_v<Queue, wait_mpsc_queue<typename Queue::value_type>> ||
-                        is_overflow)
+                    if constexpr (is_blocking<Queue>)
                     {
 
                         queue.dequeue();
                         ++amount;
 
-                        if constexpr (is_overflow)
+                        if constexpr (is_overflow<Queue>)
                         {
                             // std::cout << "Done: " << amount << "\n";
                         }
@@ -242,7 +912,1242 @@ namespace zib::test {
         return result;
     }
 
-}   // namespace zib::test
+    /* Producers spread over a sparse set of lanes, each lane's elements must come out in the
+     * order they went in.
+     */
+    template <typename Queue>
+    int
+    test_lane_order(std::size_t _lanes, std::size_t _producers, bool _bulk, std::size_t _batch)
+    {
+        static constexpr std::uint64_t kElements = 100000;
+
+        Queue                     queue(_lanes);
+        std::vector<std::jthread> threads;
+
+        for (std::size_t p = 0; p < _producers; ++p)
+        {
+            threads.emplace_back(
+                [&, p]()
+                {
+                    /* With fewer lanes than producers the rest share the overflow list */
+                    std::uint16_t t_id = _lanes >= _producers ? p * _lanes / _producers : p;
+                    std::vector<std::uint64_t> batch;
+                    for (std::uint64_t i = 0; i < kElements; ++i)
+                    {
+                        if (_batch == 1) { push(queue, (p << 32) | i, t_id); }
+                        else
+                        {
+                            batch.push_back((p << 32) | i);
+
+                            /* Uneven batches so they straddle the buffers differently */
+                            if (batch.size() == 1 + (i % _batch) || i + 1 == kElements)
+                            {
+                                push_bulk<Queue>(queue, batch, t_id);
+                                batch.clear();
+                            }
+                        }
+                    }
+                });
+        }
+
+        std::vector<std::uint64_t> next(_producers, 0);
+        std::size_t                amount = 0;
+        bool                       failed = false;
+
+        auto check = [&](std::uint64_t _element)
+        {
+            auto producer = _element >> 32;
+            if (producer >= _producers || (_element & 0xFFFFFFFF) != next[producer])
+            {
+                failed = true;
+                return;
+            }
+
+            ++next[producer];
+            ++amount;
+        };
+
+        while (_bulk && amount != kElements * _producers)
+        {
+            queue.consume_all(check);
+            if (failed) { return true; }
+        }
+
+        while (amount != kElements * _producers)
+        {
+            std::uint64_t element = 0;
+            if constexpr (is_blocking<Queue>) { element = queue.dequeue(); }
+            else
+            {
+                auto result = queue.dequeue();
+                if (!result) { continue; }
+                element = *result;
+            }
+
+            check(element);
+            if (failed) { return true; }
+        }
+
+        return false;
+    }
+
+    /* A single producer spread over the lanes gives the whole queue a known order, which the
+     * batches must come out in.
+     */
+    template <typename Queue>
+    int
+    test_bulk()
+    {
+        static constexpr std::size_t kLanes    = 3;
+        static constexpr std::size_t kElements = 3 * 4096 * kLanes + 17;
+
+        Queue queue(kLanes);
+
+        for (std::size_t i = 0; i < kElements; ++i)
+        {
+            push(queue, i, i % kLanes);
+        }
+
+        std::vector<std::uint64_t> out;
+        while (out.size() < kElements / 2)
+        {
+            if (queue.dequeue_bulk(std::back_inserter(out), 7) == 0) { return true; }
+        }
+
+        auto taken = queue.consume_all([&out](std::uint64_t _element) { out.push_back(_element); });
+        if (out.size() != kElements || taken == 0) { return true; }
+
+        for (std::size_t i = 0; i < kElements; ++i)
+        {
+            if (out[i] != i) { return true; }
+        }
+
+        /* The buffers the batches emptied must have been recycled for the lanes to keep going.
+         * Batches bigger than a buffer have to span several.
+         */
+        std::vector<std::uint64_t> in(kElements);
+        std::iota(in.begin(), in.end(), 0);
+
+        std::size_t sent = 0;
+        for (std::size_t size = 1; sent != kElements; size = size * 3 + 1)
+        {
+            auto batch = std::span<const std::uint64_t>(in).subspan(sent);
+            batch      = batch.first(std::min(batch.size(), size));
+
+            push_bulk<Queue>(queue, batch, size % kLanes);
+            sent += batch.size();
+        }
+
+        out.clear();
+        while (out.size() != kElements)
+        {
+            queue.consume_all([&out](std::uint64_t _element) { out.push_back(_element); });
+        }
+
+        for (std::size_t i = 0; i < kElements; ++i)
+        {
+            if (out[i] != i) { return true; }
+        }
+
+        return false;
+    }
+
+    /* A single producer's counters, before and after the consumer hands its buffers back */
+    template <typename Queue>
+    int
+    test_stats()
+    {
+        static constexpr std::size_t kElements = 100;
+
+        Queue queue(1);
+
+        for (std::size_t i = 0; i < kElements; ++i)
+        {
+            push(queue, i, 0);
+        }
+
+        auto stats = queue.stats(0);
+        if (stats.enqueued_ != kElements || stats.recycled_ != 0 ||
+            stats.allocated_ < kElements / 8)
+        {
+            return true;
+        }
+
+        std::size_t taken = 0;
+        while (taken != kElements)
+        {
+            taken += queue.consume_all([](std::uint64_t) {});
+        }
+
+        std::vector<std::uint64_t> in(kElements);
+        push_bulk<Queue>(queue, in, 0);
+
+        auto after = queue.stats(0);
+
+        return after.enqueued_ != 2 * kElements || after.recycled_ == 0 ||
+               after.allocated_ + after.recycled_ <= stats.allocated_;
+    }
+
+    /* Blocks of 4 stamps: each producer's elements are stamped from its own block, and a batch
+     * that runs past the end of one carries on in the next.
+     */
+    template <typename Queue>
+    int
+    test_stamp_block()
+    {
+        Queue queue(2);
+
+        push(queue, 0, 0);    /* 0, block 0 - 3 */
+        push(queue, 10, 1);   /* 4, block 4 - 7 */
+
+        std::vector<std::uint64_t> batch = {1, 2, 3, 4, 5};
+        push_bulk<Queue>(queue, batch, 0);   /* 1 - 3, then 8 - 9 of block 8 - 11 */
+
+        push(queue, 11, 1);   /* 5 */
+        push(queue, 6, 0);    /* 10 */
+
+        std::vector<std::uint64_t> out;
+        while (out.size() != 9)
+        {
+            out.push_back(queue.dequeue());
+        }
+
+        return out != std::vector<std::uint64_t>{0, 1, 2, 3, 10, 11, 4, 5, 6};
+    }
+
+    /* Recycled buffers keep their old stamps, which must read as unwritten, but must let go of
+     * the payloads the consumer has already taken.
+     */
+    template <typename Queue>
+    int
+    test_recycle()
+    {
+        static constexpr std::size_t kElements = 8 * 4 * 3;
+
+        auto  value = std::make_shared<int>(7);
+        Queue queue(1);
+
+        for (std::size_t round = 0; round < 3; ++round)
+        {
+            for (std::size_t i = 0; i < kElements; ++i)
+            {
+                queue.enqueue(value, 0);
+            }
+
+            std::size_t taken = 0;
+            while (taken != kElements)
+            {
+                if constexpr (is_blocking<Queue>) { queue.dequeue(); }
+                else
+                {
+                    if (!queue.dequeue()) { return true; }
+                }
+                ++taken;
+            }
+
+            if constexpr (!is_blocking<Queue>)
+            {
+                if (queue.dequeue()) { return true; }
+            }
+
+            /* The consumer is still on the last buffer, holding at most a buffer's worth */
+            if (value.use_count() > 1 + 8) { return true; }
+        }
+
+        return false;
+    }
+
+    /* The buffers a busy lane hands back overflow its own pool into the shared one, where a
+     * quiet lane picks them up rather than allocating.
+     */
+    template <typename Queue>
+    int
+    test_shared_pool()
+    {
+        static constexpr std::size_t kBuffers = 10;
+
+        Queue queue(2);
+
+        for (std::size_t i = 0; i < kBuffers * 8; ++i)
+        {
+            push(queue, i, 0);
+        }
+
+        std::size_t taken = 0;
+        while (taken != kBuffers * 8)
+        {
+            taken += queue.consume_all([](std::uint64_t) {});
+        }
+
+        /* One kept by lane 0's pool, eight by the shared pool and the last deleted. Lane 1 hasn't
+         * allocated yet, so all six of its buffers come from the shared pool.
+         */
+        for (std::size_t i = 0; i < 5 * 8; ++i)
+        {
+            push(queue, i, 1);
+        }
+
+        auto stats = queue.stats(1);
+
+        return stats.allocated_ != 0 || stats.recycled_ != 6;
+    }
+
+    /* Everything the queue allocates, buffers, overflow nodes and arrays, comes from the
+     * resource it was built with and is given back to it.
+     */
+    template <typename Queue>
+    int
+    test_memory_resource()
+    {
+        static constexpr std::size_t kElements = 100;
+
+        counting_resource resource;
+        {
+            track_global       = true;
+            global_allocations = 0;
+
+            Queue queue(2, &resource);
+
+            for (std::size_t i = 0; i < kElements; ++i)
+            {
+                push(queue, i, i % 2);
+                if constexpr (is_overflow<Queue>) { push(queue, i, 2); }
+            }
+
+            std::size_t taken = 0;
+            while (taken < kElements)
+            {
+                taken += queue.consume_all([](std::uint64_t) {});
+            }
+
+            if (resource.allocations_ == 0) { return true; }
+        }
+
+        track_global = false;
+
+        return resource.outstanding_ != 0 || global_allocations != 0;
+    }
+
+    /* Whatever the arena ends up backed by, a freed buffer's block is reused and a queue runs
+     * on it.
+     */
+    int
+    test_hugepage_resource()
+    {
+        static constexpr std::size_t kElements = 1000;
+        static constexpr std::size_t kBytes    = stats_wait_queue::buffer_bytes();
+
+        hugepage_resource arena(hugepage_resource::bytes_for<stats_wait_queue>(2));
+
+        auto* block = arena.allocate(kBytes, 64);
+        arena.deallocate(block, kBytes, 64);
+
+        auto* again = arena.allocate(kBytes, 64);
+        arena.deallocate(again, kBytes, 64);
+        if (block != again) { return true; }
+
+        stats_wait_queue queue(2, &arena);
+        for (std::size_t i = 0; i < kElements; ++i)
+        {
+            queue.enqueue(i, i % 2);
+        }
+
+        for (std::size_t i = 0; i < kElements; ++i)
+        {
+            if (queue.dequeue() != i) { return true; }
+        }
+
+        return false;
+    }
+
+    /* A lane allocates nothing until its producer first enqueues, and the consumer skips the
+     * lanes that haven't started.
+     */
+    template <typename Queue>
+    int
+    test_lazy_lanes()
+    {
+        static constexpr std::size_t kElements = 20;
+
+        Queue queue(3);
+        queue.bind(1, 0);
+
+        for (std::size_t i = 0; i < kElements; ++i)
+        {
+            push(queue, i, 1);
+        }
+
+        for (std::size_t i = 0; i < kElements; ++i)
+        {
+            if (queue.dequeue() != i) { return true; }
+        }
+
+        return queue.stats(0).allocated_ != 0 || queue.stats(2).allocated_ != 0 ||
+               queue.stats(1).allocated_ == 0;
+    }
+
+    /* Reserved buffers see a lane through its first rollovers without allocating, and trimming
+     * frees what the consumer has pooled, so the lane allocates again.
+     */
+    template <typename Queue>
+    int
+    test_reserve_trim()
+    {
+        static constexpr std::size_t kElements = 2 * 8;
+
+        Queue queue(2);
+        queue.reserve(0, 3);
+
+        if (queue.stats(0).allocated_ != 3) { return true; }
+
+        for (std::size_t i = 0; i < kElements; ++i)
+        {
+            push(queue, i, 0);
+        }
+
+        auto stats = queue.stats(0);
+        if (stats.allocated_ != 3 || stats.recycled_ != 0) { return true; }
+
+        std::size_t taken = 0;
+        while (taken != kElements)
+        {
+            taken += queue.consume_all([](std::uint64_t) {});
+        }
+
+        if (queue.trim() == 0 || queue.trim() != 0) { return true; }
+
+        for (std::size_t i = 0; i < kElements; ++i)
+        {
+            push(queue, i, 0);
+        }
+
+        stats = queue.stats(0);
+
+        return stats.allocated_ == 3 || stats.recycled_ != 0 || queue.stats(1).allocated_ != 0;
+    }
+
+    /* A lane that rolls over quickly grows its buffers from 4 elements to 64, and after standing
+     * idle swaps the 64 element buffers it gets back for smaller ones. A lane that rolls over
+     * slowly stays at 4. The queues read fake_time, so nothing here depends on the scheduler.
+     */
+    template <typename Queue>
+    int
+    test_adaptive()
+    {
+        static constexpr std::size_t kElements = 1000;
+
+        fake_time = std::chrono::steady_clock::time_point(std::chrono::hours(1));
+
+        Queue queue(1);
+
+        /* The clock stands still, so every buffer fills in no time */
+        for (std::size_t i = 0; i < kElements; ++i)
+        {
+            push(queue, i, 0);
+        }
+
+        /* 250 buffers at a fixed 4 elements, 4 + 8 + 16 + 32 and then 64 each growing */
+        auto stats = queue.stats(0);
+        if (stats.allocated_ > 20) { return true; }
+
+        std::vector<std::uint64_t> out;
+        while (out.size() < kElements)
+        {
+            queue.consume_all([&out](std::uint64_t _value) { out.push_back(_value); });
+        }
+
+        for (std::size_t i = 0; i < kElements; ++i)
+        {
+            if (out[i] != i) { return true; }
+        }
+
+        fake_time += 2 * wait_details::kDefaultMPSCShrinkInterval;
+
+        for (std::size_t i = 0; i < 64; ++i)
+        {
+            push(queue, i, 0);
+        }
+
+        if (queue.stats(0).allocated_ == stats.allocated_) { return true; }
+
+        /* Every buffer takes longer than the shrink interval to fill */
+        Queue slow(1);
+
+        for (std::size_t i = 0; i < 100; ++i)
+        {
+            fake_time += 2 * wait_details::kDefaultMPSCShrinkInterval;
+            push(slow, i, 0);
+        }
+
+        return slow.stats(0).allocated_ < 100 / 4;
+    }
+
+    /* Payloads are built in place and moved out. Those left behind are destroyed with the
+     * queue.
+     */
+    template <typename Queue>
+    int
+    test_emplace()
+    {
+        static constexpr std::size_t kElements = 100;
+
+        Queue queue(2);
+
+        for (std::size_t i = 0; i < kElements; ++i)
+        {
+            if constexpr (is_overflow<Queue>) { queue.safe_emplace(i % 3, i, 2 * i); }
+            else
+            {
+                queue.emplace(i % 2, i, 2 * i);
+            }
+        }
+
+        push(queue, owned(kElements, 2 * kElements), 1);
+
+        auto wrong = [](const owned& _out, std::uint64_t _expected)
+        { return !_out.value_ || *_out.value_ != _expected || _out.check_ != 2 * _expected; };
+
+        for (std::size_t i = 0; i < kElements / 2; ++i)
+        {
+            if constexpr (is_blocking<Queue>)
+            {
+                if (wrong(queue.dequeue(), i)) { return true; }
+            }
+            else
+            {
+                auto out = queue.dequeue();
+                if (!out || wrong(*out, i)) { return true; }
+            }
+        }
+
+        return false;
+    }
+
+    /* A prepared element is filled in place and stamped when it is committed, so it goes after
+     * anything enqueued in between.
+     */
+    template <typename Queue>
+    int
+    test_prepare()
+    {
+        static constexpr std::size_t kElements = 20;
+
+        Queue queue(2);
+
+        auto first = queue.prepare(0);
+        *first     = 1;
+        push(queue, 0, 1);
+        queue.commit(first);
+
+        for (std::size_t i = 2; i < kElements; ++i)
+        {
+            auto next = queue.prepare(0, 0);
+            *next     = i;
+            queue.commit(next);
+        }
+
+        std::vector<std::uint64_t> out;
+        while (out.size() < kElements)
+        {
+            queue.consume_all([&out](std::uint64_t _value) { out.push_back(_value); });
+        }
+
+        for (std::size_t i = 0; i < kElements; ++i)
+        {
+            if (out[i] != i) { return true; }
+        }
+
+        return queue.stats(0).enqueued_ != kElements - 1;
+    }
+
+    /* A peeked element stays at the front, in place, until it is popped */
+    template <typename Queue>
+    int
+    test_peek()
+    {
+        static constexpr std::size_t kElements = 50;
+
+        Queue queue(2);
+
+        for (std::size_t i = 0; i < kElements; ++i)
+        {
+            push(queue, owned(i, 2 * i), i % (is_overflow<Queue> ? 3 : 2));
+        }
+
+        for (std::size_t i = 0; i < kElements; ++i)
+        {
+            owned* front;
+            if constexpr (is_blocking<Queue>) { front = &queue.peek(); }
+            else
+            {
+                front = queue.peek();
+                if (!front) { return true; }
+            }
+
+            if (!front->value_ || *front->value_ != i || front->check_ != 2 * i) { return true; }
+
+            if constexpr (is_blocking<Queue>)
+            {
+                if (&queue.peek() != front) { return true; }
+            }
+            else
+            {
+                if (queue.peek() != front) { return true; }
+            }
+
+            queue.pop();
+        }
+
+        if constexpr (!is_blocking<Queue>)
+        {
+            if (queue.peek()) { return true; }
+        }
+
+        return false;
+    }
+
+    /* A dequeue after peek() takes the peeked element as the next one, and pop() with nothing
+     * peeked does nothing
+     */
+    template <typename Queue>
+    int
+    test_peek_take()
+    {
+        static constexpr std::size_t kElements = 8;
+
+        Queue queue(2);
+
+        for (std::size_t i = 0; i < kElements; ++i)
+        {
+            push(queue, owned(i, 2 * i), i % (is_overflow<Queue> ? 3 : 2));
+        }
+
+        auto peek = [&queue]() -> owned*
+        {
+            if constexpr (is_blocking<Queue>) { return &queue.peek(); }
+            else
+            {
+                return queue.peek();
+            }
+        };
+
+        auto wrong = [](const owned& _element, std::size_t _i)
+        { return !_element.value_ || *_element.value_ != _i || _element.check_ != 2 * _i; };
+
+        auto take = [&queue, &wrong](std::size_t _i)
+        {
+            if constexpr (is_blocking<Queue>) { return wrong(queue.dequeue(), _i); }
+            else
+            {
+                auto result = queue.dequeue();
+                return !result || wrong(*result, _i);
+            }
+        };
+
+        std::vector<owned> out;
+        std::size_t        next = 0;
+        auto               in_order = [&out, &next, &wrong]()
+        {
+            for (auto& element : out)
+            {
+                if (wrong(element, next++)) { return true; }
+            }
+
+            out.clear();
+            return false;
+        };
+
+        /* dequeue() */
+        auto* front = peek();
+        if (!front || wrong(*front, 0) || take(next++)) { return true; }
+
+        queue.pop();
+        if (take(next++)) { return true; }
+
+        /* dequeue_bulk() */
+        front = peek();
+        if (!front || wrong(*front, next)) { return true; }
+
+        if (queue.dequeue_bulk(std::back_inserter(out), 2) != 2 || in_order()) { return true; }
+
+        /* consume_all() */
+        front = peek();
+        if (!front || wrong(*front, next)) { return true; }
+
+        auto to_out = [&out](owned&& _element) { out.push_back(std::move(_element)); };
+        if (queue.consume_all(to_out) != kElements - next || in_order()) { return true; }
+
+        queue.pop();
+
+        if constexpr (!is_blocking<Queue>)
+        {
+            if (queue.peek()) { return true; }
+        }
+
+        return next != kElements;
+    }
+
+    /* Records of every size come out whole and in stamp order, across the ends of buffers */
+    int
+    test_byte_queue()
+    {
+        using queue_type = byte_mpsc_queue<256, 2>;
+
+        static constexpr std::size_t kRecords = 500;
+
+        queue_type queue(2);
+
+        auto fill = [](std::span<std::byte> _out, std::size_t _i)
+        {
+            for (std::size_t j = 0; j < _out.size(); ++j)
+            {
+                _out[j] = std::byte(_i + j);
+            }
+        };
+
+        auto wrong = [](std::span<const std::byte> _in, std::size_t _i)
+        {
+            if (_in.size() != _i % (queue_type::max_size() + 1)) { return true; }
+
+            for (std::size_t j = 0; j < _in.size(); ++j)
+            {
+                if (_in[j] != std::byte(_i + j)) { return true; }
+            }
+
+            return false;
+        };
+
+        for (std::size_t i = 0; i < kRecords; ++i)
+        {
+            auto size = i % (queue_type::max_size() + 1);
+            if (i % 3)
+            {
+                std::vector<std::byte> record(size);
+                fill(record, i);
+                queue.enqueue(record, i % 2);
+            }
+            else
+            {
+                /* Room for the largest record, cut down to the real one */
+                auto out = queue.prepare(i % 2, queue_type::max_size());
+                fill(out.first(size), i);
+                queue.commit(i % 2, size);
+            }
+        }
+
+        for (std::size_t i = 0; i < kRecords / 2; ++i)
+        {
+            auto front = queue.peek();
+            if (!front || wrong(*front, i)) { return true; }
+
+            if (queue.peek()->data() != front->data()) { return true; }
+
+            queue.pop();
+        }
+
+        /* A peeked record is the first consume_all() passes on */
+        std::size_t i = kRecords / 2;
+        if (!queue.peek()) { return true; }
+
+        auto check = [&](std::span<const std::byte> _in) { i += wrong(_in, i) ? kRecords : 1; };
+        auto taken = queue.consume_all(check);
+
+        queue.pop();
+
+        return taken != kRecords / 2 || i != kRecords || queue.peek();
+    }
+
+    /* Each producer's records keep their order while they race each other */
+    int
+    test_byte_lane_order(std::size_t _producers)
+    {
+        static constexpr std::uint64_t kRecords = 100000;
+
+        byte_mpsc_queue<1024> queue(_producers);
+
+        {
+            std::vector<std::jthread> threads;
+            for (std::size_t p = 0; p < _producers; ++p)
+            {
+                threads.emplace_back(
+                    [&, p]()
+                    {
+                        for (std::uint64_t i = 0; i < kRecords; ++i)
+                        {
+                            std::array<std::uint64_t, 3> record = {p, i, p ^ i};
+                            auto bytes = std::as_bytes(std::span(record)).first(8 * (2 + i % 2));
+                            queue.enqueue(bytes, p);
+                        }
+                    });
+            }
+
+            std::vector<std::uint64_t> expected(_producers, 0);
+            std::uint64_t              taken = 0;
+            bool                       wrong = false;
+            while (taken != _producers * kRecords && !wrong)
+            {
+                taken += queue.consume_all(
+                    [&](std::span<const std::byte> _in)
+                    {
+                        std::array<std::uint64_t, 3> record = {};
+                        std::memcpy(record.data(), _in.data(), _in.size());
+
+                        auto p = record[0];
+                        if (p >= _producers)
+                        {
+                            wrong = true;
+                            return;
+                        }
+
+                        auto i = expected[p]++;
+                        wrong |= _in.size() != 8 * (2 + i % 2) || record[1] != i ||
+                                 (_in.size() == 24 && record[2] != (p ^ i));
+                    });
+            }
+
+            if (wrong) { return true; }
+        }
+
+        return bool(queue.peek());
+    }
+
+    /* A record of max_size() bytes fits in a buffer, one byte more is refused and leaves the
+     * lane as it was
+     */
+    int
+    test_byte_max_size()
+    {
+        using queue_type = byte_mpsc_queue<256, 2>;
+
+        static constexpr auto kMax = queue_type::max_size();
+
+        queue_type             queue(1);
+        std::vector<std::byte> record(kMax + 1, std::byte(7));
+
+        /* Start part way into a buffer, so the largest record has to go in the next */
+        if (!queue.enqueue(std::span(record).first(1), 0)) { return true; }
+
+        if (!queue.enqueue(std::span(record).first(kMax), 0)) { return true; }
+
+        if (queue.enqueue(record, 0) || queue.prepare(0, kMax + 1).data()) { return true; }
+
+        auto out = queue.prepare(0, kMax);
+        if (out.size() != kMax) { return true; }
+
+        std::ranges::fill(out, std::byte(9));
+        queue.commit(0);
+
+        std::vector<std::size_t> sizes;
+        bool                     wrong = false;
+        queue.consume_all(
+            [&](std::span<const std::byte> _in)
+            {
+                sizes.push_back(_in.size());
+                wrong |= _in.back() != (sizes.size() == 3 ? std::byte(9) : std::byte(7));
+            });
+
+        return wrong || sizes != std::vector<std::size_t>{1, kMax, kMax};
+    }
+
+    /* Events of each type come out as that type, in order. Those left behind are destroyed with
+     * the queue.
+     */
+    int
+    test_variant_queue()
+    {
+        static constexpr std::size_t kEvents = 300;
+
+        variant_mpsc_queue<std::uint64_t, std::string, owned> queue(2);
+
+        for (std::size_t i = 0; i < kEvents; ++i)
+        {
+            switch (i % 3)
+            {
+                case 0:
+                    queue.enqueue(std::uint64_t(i), i % 2);
+                    break;
+                case 1:
+                    queue.emplace<std::string>(i % 2, 64, char('a' + i % 26));
+                    break;
+                case 2:
+                    queue.emplace<owned>(i % 2, i, 2 * i);
+                    break;
+            }
+        }
+
+        std::size_t seen  = 0;
+        auto        check = [&seen](const auto& _event)
+        {
+            using event_type = std::remove_cvref_t<decltype(_event)>;
+
+            bool right = false;
+            if constexpr (std::is_same_v<event_type, std::uint64_t>)
+            {
+                right = seen % 3 == 0 && _event == seen;
+            }
+            else if constexpr (std::is_same_v<event_type, std::string>)
+            {
+                right = seen % 3 == 1 && _event == std::string(64, char('a' + seen % 26));
+            }
+            else
+            {
+                right = seen % 3 == 2 && *_event.value_ == seen && _event.check_ == 2 * seen;
+            }
+
+            seen += right ? 1 : kEvents;
+
+            return right;
+        };
+
+        for (std::size_t i = 0; i < kEvents / 3; ++i)
+        {
+            if (!queue.visit(check)) { return true; }
+        }
+
+        if (queue.visit_all(check) != kEvents - kEvents / 3 || seen != kEvents) { return true; }
+
+        /* Left for the destructor */
+        queue.emplace<std::string>(0, 64, 'z');
+        queue.emplace<owned>(1, 0, 0);
+
+        return false;
+    }
+
+    /* visit() and visit_all() hand the visitor the event where it sits in the lane */
+    int
+    test_variant_in_place()
+    {
+        static constexpr std::size_t kEvents = 100;
+
+        std::size_t                                     moves = 0;
+        variant_mpsc_queue<std::uint64_t, move_counted> queue(2);
+
+        for (std::size_t i = 0; i < kEvents; ++i)
+        {
+            queue.emplace<move_counted>(i % 2, i, &moves);
+        }
+
+        std::uint64_t next  = 0;
+        bool          wrong = false;
+        auto          check = [&](const auto& _event)
+        {
+            if constexpr (std::is_same_v<std::remove_cvref_t<decltype(_event)>, move_counted>)
+            {
+                wrong |= _event.value_ != next++;
+            }
+            else
+            {
+                wrong = true;
+            }
+        };
+
+        queue.visit(check);
+
+        return wrong || queue.visit_all(check) != kEvents - 1 || next != kEvents || moves != 0;
+    }
+
+    /* A thread leases one of the lease_lanes() the first time it enqueues without one and
+     * hands it back when it exits, for the next thread to lease
+     */
+    template <typename Queue>
+    int
+    test_lease()
+    {
+        static constexpr std::uint64_t kElements = 1000;
+
+        Queue                        queue(2);
+        std::optional<std::uint16_t> first;
+        std::optional<std::uint16_t> again;
+        bool                         full = true;
+
+        if (queue.lease()) { return true; }
+
+        auto leasable = queue.lease_lanes(2);
+        auto mine     = queue.lease();
+        if (!mine || *mine < leasable || queue.lease() != mine) { return true; }
+
+        std::jthread(
+            [&]()
+            {
+                first = queue.lease();
+
+                /* Both lanes are leased now */
+                std::jthread([&]() { full = !queue.lease(); }).join();
+
+                for (std::uint64_t i = 0; i < kElements; ++i)
+                {
+                    queue.enqueue((std::uint64_t{1} << 32) | i);
+                }
+            })
+            .join();
+
+        std::jthread([&]() { again = queue.lease(); }).join();
+
+        if (!full || !first || first == mine || again != first) { return true; }
+
+        for (std::uint64_t i = 0; i < kElements; ++i)
+        {
+            queue.enqueue(i);
+        }
+
+        std::array<std::uint64_t, 2> expected = {};
+        std::uint64_t                taken    = 0;
+        bool                         wrong    = false;
+        while (taken != 2 * kElements)
+        {
+            taken += queue.consume_all(
+                [&](std::uint64_t _value)
+                {
+                    auto p = _value >> 32;
+                    wrong |= p > 1 || (_value & 0xFFFFFFFF) != expected[p & 1]++;
+                });
+        }
+
+        return wrong || queue.stats(*mine).enqueued_ != kElements ||
+               queue.stats(*first).enqueued_ != kElements;
+    }
+
+    /* With every lane leased, enqueue() is refused by the queues without an overflow list and
+     * goes to the list in those with one
+     */
+    template <typename Queue>
+    int
+    test_lease_full()
+    {
+        Queue queue(2);
+        queue.lease_lanes(2);
+
+        bool wrong = !queue.lease();
+
+        std::jthread(
+            [&]()
+            {
+                wrong |= !queue.lease();
+
+                std::jthread(
+                    [&]()
+                    {
+                        if constexpr (std::is_same_v<
+                                          decltype(queue.enqueue(std::uint64_t{})),
+                                          bool>)
+                        {
+                            wrong |= queue.enqueue(std::uint64_t{7});
+                        }
+                        else
+                        {
+                            queue.enqueue(std::uint64_t{7});
+                            wrong |= queue.dequeue() != 7;
+                        }
+                    })
+                    .join();
+            })
+            .join();
+
+        return wrong;
+    }
+
+    /* A thread still holding its lease when the queue is destroyed holds nothing of the
+     * queue's resource
+     */
+    template <typename Queue>
+    int
+    test_lease_outlives()
+    {
+        counting_resource     resource;
+        std::optional<Queue>  queue(std::in_place, 2, &resource);
+        std::binary_semaphore leased(0);
+        std::binary_semaphore destroyed(0);
+        bool                  wrong = false;
+
+        queue->lease_lanes(1);
+
+        std::jthread thread(
+            [&]()
+            {
+                wrong |= !queue->lease();
+                leased.release();
+                destroyed.acquire();
+            });
+
+        leased.acquire();
+        queue.reset();
+        auto kept = resource.outstanding_ != 0;
+
+        destroyed.release();
+        thread.join();
+
+        return wrong || kept;
+    }
+
+    /* Threads that lease a lane and threads that pass their own t_id share a queue without
+     * ever enqueuing on the same lane
+     */
+    template <typename Queue>
+    int
+    test_lease_mixed()
+    {
+        static constexpr std::uint64_t kElements = 10000;
+
+        Queue queue(2);
+
+        /* Nothing to lease yet, the explicit lanes aren't handed out */
+        if (queue.lease()) { return true; }
+
+        auto                                         first = queue.lease_lanes(2);
+        std::array<std::optional<std::uint16_t>, 2> leased;
+        std::vector<std::jthread>                    threads;
+
+        for (std::uint16_t t_id = 0; t_id < 2; ++t_id)
+        {
+            threads.emplace_back(
+                [&queue, t_id]()
+                {
+                    for (std::uint64_t i = 0; i < kElements; ++i)
+                    {
+                        push(queue, (std::uint64_t(t_id) << 32) | i, t_id);
+                    }
+                });
+        }
+
+        for (std::uint64_t p = 2; p < 4; ++p)
+        {
+            threads.emplace_back(
+                [&, p]()
+                {
+                    leased[p - 2] = queue.lease();
+                    for (std::uint64_t i = 0; i < kElements; ++i)
+                    {
+                        queue.enqueue((p << 32) | i);
+                    }
+                });
+        }
+
+        std::array<std::uint64_t, 4> expected = {};
+        std::uint64_t                taken    = 0;
+        bool                         wrong    = false;
+        while (taken != 4 * kElements && !wrong)
+        {
+            taken += queue.consume_all(
+                [&](std::uint64_t _value)
+                {
+                    auto p = _value >> 32;
+                    wrong |= p > 3 || (_value & 0xFFFFFFFF) != expected[p & 3]++;
+                });
+        }
+
+        threads.clear();
+
+        return wrong || !leased[0] || !leased[1] || *leased[0] < first || *leased[1] < first ||
+               queue.stats(0).enqueued_ != kElements || queue.stats(1).enqueued_ != kElements;
+    }
+
+    /* Lanes added while the consumer is taking from the queue keep their producers' order */
+    template <typename Queue>
+    int
+    test_add_lanes()
+    {
+        static constexpr std::uint64_t kElements = 10000;
+        static constexpr std::size_t   kAdded    = 30;
+
+        Queue                     queue(2);
+        std::vector<std::jthread> threads;
+
+        auto produce = [&queue](std::uint16_t _t_id)
+        {
+            for (std::uint64_t i = 0; i < kElements; ++i)
+            {
+                push(queue, (std::uint64_t(_t_id) << 32) | i, _t_id);
+            }
+        };
+
+        for (std::uint16_t t_id = 0; t_id < 2; ++t_id)
+        {
+            threads.emplace_back(produce, t_id);
+        }
+
+        std::vector<std::uint64_t> expected(2 + kAdded, 0);
+        std::uint64_t              taken = 0;
+        bool                       wrong = false;
+
+        auto check = [&](std::uint64_t _value)
+        {
+            auto t_id = _value >> 32;
+            wrong |= t_id >= expected.size() || (_value & 0xFFFFFFFF) != expected[t_id]++;
+        };
+
+        /* Grown a few at a time, over more than one segment, while the first lanes are busy */
+        for (std::size_t added = 0; added < kAdded; added += 5)
+        {
+            auto first = queue.add_lanes(5);
+            if (first != 2 + added || queue.lanes() != 2 + added + 5) { return true; }
+
+            for (std::uint16_t t_id = first; t_id < first + 5; ++t_id)
+            {
+                threads.emplace_back(produce, t_id);
+            }
+
+            taken += queue.consume_all(check);
+        }
+
+        while (taken != (2 + kAdded) * kElements && !wrong)
+        {
+            taken += queue.consume_all(check);
+        }
+
+        return wrong;
+    }
+
+}   // namespace zib::test
+
+/* Counts into zib::test::global_allocations while tracking. The deletes aren't inlined, GCC
+ * can't tell they match the replaced news.
+ */
+void*
+operator new(std::size_t _bytes)
+{
+    if (zib::test::track_global) { ++zib::test::global_allocations; }
+
+    if (auto* ptr = std::malloc(_bytes ? _bytes : 1)) { return ptr; }
+
+    throw std::bad_alloc();
+}
+
+void*
+operator new(std::size_t _bytes, std::align_val_t _alignment)
+{
+    if (zib::test::track_global) { ++zib::test::global_allocations; }
+
+    auto alignment = std::max(static_cast<std::size_t>(_alignment), sizeof(void*));
+    auto bytes     = (std::max<std::size_t>(_bytes, 1) + alignment - 1) / alignment * alignment;
+
+    if (auto* ptr = std::aligned_alloc(alignment, bytes)) { return ptr; }
+
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void
+operator delete(void* _ptr) noexcept
+{
+    std::free(_ptr);
+}
+
+[[gnu::noinline]] void
+operator delete(void* _ptr, std::size_t) noexcept
+{
+    std::free(_ptr);
+}
+
+[[gnu::noinline]] void
+operator delete(void* _ptr, std::align_val_t) noexcept
+{
+    std::free(_ptr);
+}
+
+[[gnu::noinline]] void
+operator delete(void* _ptr, std::size_t, std::align_val_t) noexcept
+{
+    std::free(_ptr);
+}
 
 int
 main()